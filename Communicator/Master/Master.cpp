@@ -7,32 +7,42 @@
 
 #include "Master.h" 
 
-Command_Packet::Command_Packet(byte id, Commands::Commands_Enum command)
-    :_id(id), _command(command) {}
+//------------------------------------------------------------------
+
+Command_Packet::Command_Packet(byte id, Commands::Commands_Enum command, byte p0, byte p1, byte p2, byte p3, byte p4, byte p5)
+    :_id(id), _command(command)
+{
+    Parameter[0] = p0;
+    Parameter[1] = p1;
+    Parameter[2] = p2;
+    Parameter[3] = p3;
+    Parameter[4] = p4;
+    Parameter[5] = p5;
+}
 
 
-// returns the 10 bytes of the generated command packet
-// remember to call delete on the returned array
-byte* Command_Packet::GetPacketBytes()
+void Command_Packet::GetPacketBytes(byte* out, uint8_t version) const
 {
-    byte* packetbytes= new byte[10];
-    
-    packetbytes[0] = COMMAND_START_CODE;
-    packetbytes[1] = _id;
-    packetbytes[2] = _command;
-    
-    for(uint8_t i = 0 ; i < 6 ; i++)
-        packetbytes[i+3] = Parameter[i];
+    out[0] = (version >= 2) ? Protocol::COMMAND_START_CODE_V2 : Protocol::COMMAND_START_CODE;
+    out[1] = _id;
+    out[2] = _command;
+    for(uint8_t i = 0 ; i < Protocol::PARAMETER_COUNT ; i++)
+        out[i+3] = Parameter[i];
+    out[Protocol::COMMAND_LENGTH-1] = (version >= 2) ? Protocol::crc8(&out[1], Protocol::COMMAND_LENGTH - 2) : Protocol::COMMAND_END_CODE;
+}
 
-    packetbytes[9] = COMMAND_END_CODE;
+void Command_Packet::WriteBatchEntry(byte* entry) const
+{
+    entry[0] = _command;
 
-    return packetbytes;
+    for(uint8_t i = 0 ; i < Protocol::PARAMETER_COUNT ; i++)
+        entry[i+1] = Parameter[i];
 }
 
 //------------------------------------------------------------------
 
 
-bool Response_Packet::CheckParsing(byte b, byte propervalue, char* varname, bool UseSerialDebug)
+bool Response_Packet::CheckParsing(byte b, byte propervalue, const char* varname, bool UseSerialDebug)
 {
 	bool retval = (b == propervalue);
 	if ((UseSerialDebug) && (!retval))
@@ -49,11 +59,20 @@ bool Response_Packet::CheckParsing(byte b, byte propervalue, char* varname, bool
 
 Response_Packet::Response_Packet(byte* buffer, bool UseSerialDebug)
 {
-	CheckParsing(buffer[0], RESPONSE_START_CODE, "RESPONSE_START_CODE", UseSerialDebug);
+	if(buffer[0] == Protocol::RESPONSE_START_CODE_V2)
+	{
+		version = 2;
+		valid = CheckParsing(buffer[3], Protocol::crc8(&buffer[1], 2), "RESPONSE_CRC8", UseSerialDebug);
+	}
+	else
+	{
+		version = 1;
+		valid = CheckParsing(buffer[0], Protocol::RESPONSE_START_CODE, "RESPONSE_START_CODE", UseSerialDebug);
+		valid &= CheckParsing(buffer[3], Protocol::RESPONSE_END_CODE, "RESPONSE_END_CODE", UseSerialDebug);
+	}
 	_id = buffer[1];
-	status = (buffer[2] == OK);
-
-	CheckParsing(buffer[3], RESPONSE_END_CODE, "RESPONSE_END_CODE", UseSerialDebug);
+	status = (buffer[2] == Protocol::OK);
+	inProgress = (buffer[2] == Protocol::IN_PROGRESS);
 }
 
 
@@ -61,362 +80,790 @@ Response_Packet::Response_Packet(byte* buffer, bool UseSerialDebug)
 
 Data_Packet::Data_Packet(char* str)
 {
-	data[0] = DATA_START_CODE;
+	data[0] = Protocol::DATA_START_CODE;
 	uint8_t i = 1;
-	for( ; i < 18, *str; i++, str++)
+	for( ; i < Protocol::DATA_LENGTH - 2 && *str; i++, str++)
 	{
 		data[i] = *str;
 	}
 	data[i] = '\0';
-	data[19] = DATA_END_CODE;
+	data[Protocol::DATA_LENGTH - 1] = Protocol::DATA_END_CODE;
 }
 
 
 //------------------------------------------------------------------
 
-Communicator::Communicator()
+Communicator* Communicator::_endpoints = NULL;
+
+Communicator::Communicator(TwoWire& wire): _next(_endpoints), _wire(wire), _version(0)
 {
 	randomSeed(analogRead(0));
+	_endpoints = this;
+}
+
+Communicator::~Communicator()
+{
+	for(Communicator** ep = &_endpoints ; *ep ; ep = &(*ep)->_next)
+		if(*ep == this)
+		{
+			*ep = _next;
+			break;
+		}
 }
 
-void Communicator::begin(uint8_t slaveAddress)
+void Communicator::begin(uint8_t slaveAddress, uint32_t clock)
 {
 	_slaveAddress = slaveAddress; 
 	_commandSent = false;
-	Wire.begin();
+	_commandAcked = true;
+	_flowControl = false;
+	_batching = false;
+	_reliable = false;
+	_maxRetries = 0;
+	_holdOff = false;
+	_trace = NULL;
+	_ticket = 0;
+	_queued = 0;
+	_inFlight = NO_SLOT;
+	_stats = Link_Stats();
+	_pollResult = Poll_Result::Ok;
+	_responseTimeout = RESPONSE_TIMEOUT;
+	_batchLength = Protocol::BATCH_HEADER_SIZE;
+	_batchCount = 0;
+	_coalescing = false;
+	_leftPending = _rightPending = false;
+	_coalesceInterval = COALESCE_INTERVAL;
+	_motorTime = 0;
+	_sequence = random(256);
+	_lastCommandID = _sequence;
+	_debug = false;
+	_wire.begin();
+	_wire.setClock(clock);
+	_negotiateVersion();
 }
 
-void Communicator::drawPoint(uint8_t x0, uint8_t y0)
+void Communicator::setDebug(bool enable)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::DrawPoint);
-	cp->Parameter[0] = x0;
-	cp->Parameter[1] = y0;
-	cp->Parameter[2] = 0x00;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	_debug = enable;
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::setTrace(Print* out)
+{
+	_trace = out;
+}
 
-	delete cp;
-	delete packetbytes;
+void Communicator::printStats(Print& out)
+{
+	out.print("sent: ");
+	out.print(_stats.framesSent);
+	out.print("\treceived: ");
+	out.print(_stats.framesReceived);
+	out.print("\tcorrupt: ");
+	out.print(_stats.corruptFrames);
+	out.print("\tid mismatches: ");
+	out.print(_stats.idMismatches);
+	out.print("\tretries: ");
+	out.print(_stats.retries);
+	out.print("\ttimeouts: ");
+	out.print(_stats.timeouts);
+	out.print("\tmax round trip: ");
+	out.println(_stats.maxRoundTrip);
+	_stats.roundTrips.print(out);
 }
 
-void Communicator::drawLine(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1)
+void Communicator::setFlowControl(bool enable)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::DrawLine);
-	cp->Parameter[0] = x0;
-	cp->Parameter[1] = y0;
-	cp->Parameter[2] = x1;
-	cp->Parameter[3] = y1;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	_flowControl = enable;
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::setReliable(bool enable, uint8_t retries)
+{
+	_reliable = enable;
+	_maxRetries = retries;
+}
 
-	delete cp;
-	delete packetbytes;
+void Communicator::setCoalescing(bool enable, uint16_t interval)
+{
+	if(!enable) flushMotors();
+	_coalescing = enable;
+	_coalesceInterval = interval;
 }
 
-void Communicator::drawCircle(uint8_t x, uint8_t y, uint8_t radius)
+void Communicator::BeginBatch()
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::DrawCircle);
-	cp->Parameter[0] = x;
-	cp->Parameter[1] = y;
-	cp->Parameter[2] = radius;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	_batching = true;
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::EndBatch()
+{
+	_flushBatch();
+	_batching = false;
+}
 
-	delete cp;
-	delete packetbytes;
+// returns the next command sequence number. Consecutive commands never share an id,
+// so an echoed id unambiguously acknowledges the last command.
+// The sequence starts at a random value so that a reset master does not match a stale response.
+byte Communicator::_nextCommandID()
+{
+	if(++_sequence == Protocol::BROADCAST_ID) ++_sequence;
+	return _sequence;
 }
 
-void Communicator::drawDisc(uint8_t x, uint8_t y, uint8_t radius)
+uint8_t Communicator::negotiate()
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::DrawDisc);
-	cp->Parameter[0] = x;
-	cp->Parameter[1] = y;
-	cp->Parameter[2] = radius;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	// The probes take over the slave like any blocking command.
+	flushMotors();
+	_drainSubmitted();
+	if(_batching) _flushBatch();
+	if(_flowControl) _awaitAck();
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+	_negotiateVersion();
+	_commandSent = false;
+	_pollResult = Poll_Result::Ok;
+	return _version;
+}
 
-	delete cp;
-	delete packetbytes;
+// probes the slave with a version 2 packet. Slaves that predate version 2 ignore
+// the probe and keep answering version 1 responses, so the master falls back to version 1.
+void Communicator::_negotiateVersion()
+{
+	for(uint8_t i = 0 ; i < VERSION_PROBES ; i++)
+	{
+		Command_Packet cp(_nextCommandID(), Command_Packet::Commands::Version, PROTOCOL_VERSION);
+
+		_writeCommand(cp, PROTOCOL_VERSION);
+		_sendTime = micros();
+		_lastCommandID = cp._id;
+		_commandAcked = false;
+
+		if(_awaitAck(VERSION_TIMEOUT) && _responseVersion >= 2)
+		{
+			_version = PROTOCOL_VERSION;
+			return;
+		}
+	}
+	_version = 1;
+	_commandAcked = true;
 }
 
-void Communicator::drawTriangle(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2)
+// builds the command packet in place and sends it, shared by all command methods
+void Communicator::_sendCommand(Command_Packet::Commands::Commands_Enum command, byte p0, byte p1, byte p2, byte p3, byte p4, byte p5)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::DrawTriangle);
-	cp->Parameter[0] = x0;
-	cp->Parameter[1] = y0;
-	cp->Parameter[2] = x1;
-	cp->Parameter[3] = y1;
-	cp->Parameter[4] = x2;
-	cp->Parameter[5] = y2;
+	sendCommand(Command_Packet(_nextCommandID(), command, p0, p1, p2, p3, p4, p5));
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::drawPoint(uint8_t x0, uint8_t y0)
+{
+	_sendCommand(Command_Packet::Commands::DrawPoint, x0, y0);
+}
 
-	delete cp;
-	delete packetbytes;
+void Communicator::drawLine(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1)
+{
+	_sendCommand(Command_Packet::Commands::DrawLine, x0, y0, x1, y1);
 }
 
-void Communicator::drawRectangle(uint8_t x, uint8_t y, uint8_t width, uint8_t height)
+void Communicator::drawCircle(uint8_t x, uint8_t y, uint8_t radius)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::DrawRectangle);
-	cp->Parameter[0] = x;
-	cp->Parameter[1] = y;
-	cp->Parameter[2] = width;
-	cp->Parameter[3] = height;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	_sendCommand(Command_Packet::Commands::DrawCircle, x, y, radius);
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::drawDisc(uint8_t x, uint8_t y, uint8_t radius)
+{
+	_sendCommand(Command_Packet::Commands::DrawDisc, x, y, radius);
+}
 
-	delete cp;
-	delete packetbytes;
+void Communicator::drawTriangle(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2)
+{
+	_sendCommand(Command_Packet::Commands::DrawTriangle, x0, y0, x1, y1, x2, y2);
+}
+
+void Communicator::drawRectangle(uint8_t x, uint8_t y, uint8_t width, uint8_t height)
+{
+	_sendCommand(Command_Packet::Commands::DrawRectangle, x, y, width, height);
 }
 
 void Communicator::drawBox(uint8_t x, uint8_t y, uint8_t width, uint8_t height)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::DrawBox);
-	cp->Parameter[0] = x;
-	cp->Parameter[1] = y;
-	cp->Parameter[2] = width;
-	cp->Parameter[3] = height;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	_sendCommand(Command_Packet::Commands::DrawBox, x, y, width, height);
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::drawText(char *str)
+{
+	_sendCommand(Command_Packet::Commands::DrawText);
 
-	delete cp;
-	delete packetbytes;
+	if(_version >= 2)
+		_sendText(str);
+	else
+	{
+		Data_Packet dp(str);
+		sendData(dp);
+	}
 }
 
-void Communicator::drawText(char *str)
+void Communicator::clearScreen()
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::DrawText);
-	cp->Parameter[0] = 0x00;
-	cp->Parameter[1] = 0x00;
-	cp->Parameter[2] = 0x00;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	_sendCommand(Command_Packet::Commands::ClearScreen);
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::leftMotor(uint8_t dir, uint8_t speed)
+{
+	if(_coalescing)
+		_setMotors(true, dir, speed, false, 0, 0);
+	else
+		_sendCommand(Command_Packet::Commands::LeftMotor, dir, speed);
+}
 
-	delete cp;
-	delete packetbytes;
+void Communicator::rightMotor(uint8_t dir, uint8_t speed)
+{
+	if(_coalescing)
+		_setMotors(false, 0, 0, true, dir, speed);
+	else
+		_sendCommand(Command_Packet::Commands::RightMotor, dir, speed);
+}
 
-	Data_Packet *dp = new Data_Packet(str);
-	sendData(dp->data);
-	delete dp;
+void Communicator::move(uint8_t dir, uint8_t speed)
+{
+	// Mapped once here, the slave applies Move and Drive as PWM alike.
+	speed = map(speed, 0, 100, 0, 255);
+	if(_coalescing)
+		_setMotors(true, dir, speed, true, dir, speed);
+	else
+		_sendCommand(Command_Packet::Commands::Move, dir, speed);
 }
 
-void Communicator::clearScreen()
+void Communicator::moveDistance(uint8_t cm, uint8_t dir, uint8_t speed)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::ClearScreen);
-	cp->Parameter[0] = 0x00;
-	cp->Parameter[1] = 0x00;
-	cp->Parameter[2] = 0x00;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	if(_version >= 2)
+		moveMillimeters((dir == 0) ? -10L*cm : 10L*cm, 10*speed);
+	else
+		_sendCommand(Command_Packet::Commands::MoveDistance, cm, dir, speed);
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::moveMillimeters(int32_t mm, uint16_t speed)
+{
+	if(_version < 2)
+	{
+		// Version 1 slaves only take up to 255 cm.
+		uint32_t cm = (mm < 0) ? -mm/10 : mm/10;
+		_sendCommand(Command_Packet::Commands::MoveDistance, (cm > 255) ? 255 : cm, mm >= 0, 0);
+		return;
+	}
 
-	delete cp;
-	delete packetbytes;
+	byte p[Protocol::PARAMETER_COUNT];
+	Protocol::writeInt32(p, mm);
+	Protocol::writeInt16(&p[4], speed);
+	_sendCommand(Command_Packet::Commands::MoveMillimeters, p[0], p[1], p[2], p[3], p[4], p[5]);
 }
 
-void Communicator::leftMotor(uint8_t dir, uint8_t speed)
+
+void Communicator::stop()
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::LeftMotor);
-	cp->Parameter[0] = dir;
-	cp->Parameter[1] = speed;
-	cp->Parameter[2] = 0x00;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	_sendCommand(Command_Packet::Commands::Stop);
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::turnAngle(uint8_t degree, uint8_t dir, uint8_t speed)
+{
+	if(_version >= 2)
+	{
+		turnCentidegrees((dir == 1) ? -100L*degree : 100L*degree, speed);
+		return;
+	}
 
-	delete cp;
-	delete packetbytes;
+	float fd = degree;
+	fd = (fd*255/360);
+	degree = fd;
+	_sendCommand(Command_Packet::Commands::TurnAngle, degree, dir, speed);
 }
 
-void Communicator::rightMotor(uint8_t dir, uint8_t speed)
+void Communicator::turnCentidegrees(int32_t centidegrees, uint16_t speed)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::RightMotor);
-	cp->Parameter[0] = dir;
-	cp->Parameter[1] = speed;
-	cp->Parameter[2] = 0x00;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	if(_version < 2)
+	{
+		// Version 1 slaves only take whole turns squashed into a byte.
+		uint32_t degree = ((centidegrees < 0) ? -centidegrees : centidegrees) / 100;
+		turnAngle((degree > 255) ? 255 : degree, centidegrees < 0, 0);
+		return;
+	}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+	byte p[Protocol::PARAMETER_COUNT];
+	Protocol::writeInt32(p, centidegrees);
+	Protocol::writeInt16(&p[4], speed);
+	_sendCommand(Command_Packet::Commands::TurnCentidegrees, p[0], p[1], p[2], p[3], p[4], p[5]);
+}
 
-	delete cp;
-	delete packetbytes;
+void Communicator::turn(uint8_t speed, uint8_t dir)
+{
+	// Same directions as the slave's Turn: dir 0 turns right, anything else turns left.
+	if(_coalescing)
+		_setMotors(true, dir == 0, speed, true, dir != 0, speed);
+	else
+		_sendCommand(Command_Packet::Commands::Turn, dir, speed);
 }
 
-void Communicator::move(uint8_t dir, uint8_t speed)
+// records the latest setpoint of the given motors and sends them once the coalescing interval has passed
+void Communicator::_setMotors(bool left, uint8_t leftDir, uint8_t leftSpeed, bool right, uint8_t rightDir, uint8_t rightSpeed)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::Move);
-	cp->Parameter[0] = dir;
-	cp->Parameter[1] = map(speed, 0, 100, 0, 255);
-	cp->Parameter[2] = 0x00;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	if(left)
+	{
+		_leftDir = leftDir;
+		_leftSpeed = leftSpeed;
+		_leftPending = true;
+	}
+	if(right)
+	{
+		_rightDir = rightDir;
+		_rightSpeed = rightSpeed;
+		_rightPending = true;
+	}
+	flushMotors(false);
+}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+void Communicator::flushMotors(bool force)
+{
+	if(!_leftPending && !_rightPending) return;
+	if(!force && millis() - _motorTime < _coalesceInterval) return;
 
-	delete cp;
-	delete packetbytes;
+	// Clear first, sendCommand() flushes pending setpoints itself.
+	bool left = _leftPending, right = _rightPending;
+	_leftPending = _rightPending = false;
+	_motorTime = millis();
+
+	if(left && right && _version >= 2)
+		_sendCommand(Command_Packet::Commands::Drive, _leftDir, _leftSpeed, _rightDir, _rightSpeed);
+	else
+	{
+		// Version 1 slaves do not know Drive.
+		if(left) _sendCommand(Command_Packet::Commands::LeftMotor, _leftDir, _leftSpeed);
+		if(right) _sendCommand(Command_Packet::Commands::RightMotor, _rightDir, _rightSpeed);
+	}
 }
 
-void Communicator::moveDistance(uint8_t cm, uint8_t dir, uint8_t speed)
+void Communicator::sendCommand(const Command_Packet& cp)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::MoveDistance);
-	cp->Parameter[0] = cm;
-	cp->Parameter[1] = dir;
-	cp->Parameter[2] = speed;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	// Pending motor setpoints and submitted commands were set before this command.
+	flushMotors();
+	_drainSubmitted();
+
+	if(_batching)
+	{
+		// Keep one byte free for the end code.
+		if(_batchLength + Protocol::BATCH_ENTRY_SIZE >= WIRE_BUFFER_LENGTH)
+			_flushBatch();
+
+		cp.WriteBatchEntry(&_batch[_batchLength]);
+		_batchLength += Protocol::BATCH_ENTRY_SIZE;
+		_batchCount++;
+		return;
+	}
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+	if(_flowControl) _awaitAck();
 
-	delete cp;
-	delete packetbytes;
+	uint8_t attempt = 0;
+	do {
+		_pace();
+		_writeCommand(cp, _version);
+	} while(_transmitted(cp._id, attempt++));
 }
 
-
-void Communicator::stop()
+void Communicator::sendData(const Data_Packet& dp)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::Stop);
-	cp->Parameter[0] = 0x00;
-	cp->Parameter[1] = 0x00;
-	cp->Parameter[2] = 0x00;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	// The slave expects the data right after the command that announced it.
+	if(_batching) _flushBatch();
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+	_pace();
+	_transfer((const byte*)dp.data, Protocol::DATA_LENGTH);
+	_paced();
+}
 
-	delete cp;
-	delete packetbytes;
+// sends str as Text Packets, one chunk per transfer
+void Communicator::_sendText(const char* str)
+{
+	// The slave expects the text right after the command that announced it.
+	if(_batching) _flushBatch();
+
+	byte chunk[WIRE_BUFFER_LENGTH];
+	size_t remaining = strlen(str);
+	do {
+		uint8_t length = (remaining > Protocol::TEXT_CHUNK_LENGTH) ? Protocol::TEXT_CHUNK_LENGTH : remaining;
+		remaining -= length;
+
+		chunk[0] = Protocol::TEXT_START_CODE;
+		chunk[1] = length;
+		chunk[2] = (remaining > 0) ? 1 : 0;
+		memcpy(&chunk[Protocol::TEXT_HEADER_SIZE], str, length);
+		chunk[Protocol::TEXT_HEADER_SIZE + length] = Protocol::crc8(&chunk[1], length + 2);
+
+		_pace();
+		_transfer(chunk, Protocol::TEXT_HEADER_SIZE + length + 1);
+
+		str += length;
+		_paced();
+	} while(remaining > 0);
 }
 
-void Communicator::turnAngle(uint8_t degree, uint8_t dir, uint8_t speed)
+// sends the pending batch entries as one Batch Packet
+void Communicator::_flushBatch()
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::TurnAngle);
-	float fd = degree;
-	fd = (fd*255/360);
-	degree = fd;
-	cp->Parameter[0] = degree;
-	cp->Parameter[1] = dir;
-	cp->Parameter[2] = speed;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	if(_batchCount == 0) return;
+
+	if(_flowControl) _awaitAck();
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+	_batch[0] = (_version >= 2) ? Protocol::BATCH_START_CODE_V2 : Protocol::BATCH_START_CODE;
+	_batch[1] = _nextCommandID();
+	_batch[2] = _batchCount;
+	_batch[_batchLength] = (_version >= 2) ? Protocol::crc8(&_batch[1], _batchLength - 1) : Protocol::BATCH_END_CODE;
+	_batchLength++;
 
-	delete cp;
-	delete packetbytes;
+	uint8_t attempt = 0;
+	do {
+		_pace();
+		_transfer(_batch, _batchLength);
+	} while(_transmitted(_batch[1], attempt++));
+
+	_batchLength = Protocol::BATCH_HEADER_SIZE;
+	_batchCount = 0;
 }
 
-void Communicator::turn(uint8_t speed, uint8_t dir)
+// bookkeeping after a packet with the given id has been written to the bus.
+// In reliable mode waits for its acknowledge and returns true if it has to be sent again.
+bool Communicator::_transmitted(byte id, uint8_t attempt)
 {
-	_lastCommandID = random(255);
-	Command_Packet *cp = new Command_Packet(_lastCommandID, Command_Packet::Commands::Turn);
-	cp->Parameter[0] = dir;
-	cp->Parameter[1] = speed;
-	cp->Parameter[2] = 0x00;
-	cp->Parameter[3] = 0x00;
-	cp->Parameter[4] = 0x00;
-	cp->Parameter[5] = 0x00;
+	_markSent(id, attempt);
+	if(!_reliable) return false;
 
-	byte *packetbytes = cp->GetPacketBytes();
-	sendCommand(packetbytes);
+	if(_awaitAck(_retryTimeout(attempt))) return false;
 
-	delete cp;
-	delete packetbytes;
+	if(attempt < _maxRetries)
+	{
+		_stats.retries++;
+		return true;
+	}
+	_stats.timeouts++;
+	return false;
+}
+
+// acknowledge timeout of the given transmission, doubled per retry and capped at ACK_TIMEOUT
+uint16_t Communicator::_retryTimeout(uint8_t attempt)
+{
+	uint32_t timeout = (attempt < 16) ? (uint32_t)RETRY_TIMEOUT << attempt : ACK_TIMEOUT;
+	return (timeout < ACK_TIMEOUT) ? timeout : ACK_TIMEOUT;
 }
 
-void Communicator::sendCommand(byte* packetbytes)
+// records id as the last command, whose response is awaited from now on
+void Communicator::_markSent(byte id, uint8_t attempt)
 {
-	Wire.beginTransmission(_slaveAddress);
-	Wire.write(packetbytes, 10);
-	Wire.endTransmission();
+	_lastCommandID = id;
 	_commandSent = true;
-	delay(30);
+	_commandAcked = false;
+	_pollResult = Poll_Result::Pending;
+	if(attempt == 0) _sendTime = micros();
+	_paced();
 }
 
-void Communicator::sendData(byte* packetbytes)
+// encodes the command packet and writes it to the slave
+void Communicator::_writeCommand(const Command_Packet& cp, uint8_t version)
 {
-	Wire.beginTransmission(_slaveAddress);
-	Wire.write(packetbytes, 20);
-	Wire.endTransmission();
-	delay(30);
+	byte packetBytes[Protocol::COMMAND_LENGTH];
+	cp.GetPacketBytes(packetBytes, version);
+	_transfer(packetBytes, Protocol::COMMAND_LENGTH);
 }
 
-bool Communicator::recieveResponse()
+// writes one frame to the slave in a single transfer, every packet sent to the slave goes through here
+void Communicator::_transfer(const byte* frame, uint8_t length)
 {
-	if(!_commandSent) return true;
+	_traceFrame(_slaveAddress, frame, length);
+	_wire.beginTransmission(_slaveAddress);
+	_wire.write(frame, length);
+	_wire.endTransmission();
+	_stats.framesSent++;
+}
+
+// appends a Trace Record for the frame if tracing is enabled
+void Communicator::_traceFrame(uint8_t address, const byte* frame, uint8_t length)
+{
+	if(!_trace) return;
+
+	byte header[Protocol::TRACE_HEADER_SIZE];
+	Protocol::writeInt32(header, micros());
+	header[4] = address;
+	header[5] = length;
+	_trace->write(header, Protocol::TRACE_HEADER_SIZE);
+	_trace->write(frame, length);
+}
+
+// waits until the slave had COMMAND_DELAY to process the previous transfer.
+// The wait is taken right before the next transfer to this slave, so the master is free
+// to talk to other slaves in between.
+void Communicator::_pace()
+{
+	if(!_holdOff) return;
+	while(millis() - _transferTime < COMMAND_DELAY);
+	_holdOff = false;
+}
 
-	Wire.requestFrom(int(_slaveAddress), 4);
-	while(Wire.available() < 4)	delay(10);
+// starts the hold-off after a transfer, unless the master paces by acknowledges
+void Communicator::_paced()
+{
+	if(_flowControl || _reliable) return;
+	_holdOff = true;
+	_transferTime = millis();
+}
 
-	byte temp[4];
-	for(uint8_t i = 0 ; i < 4 ; i++)
-		temp[i] = Wire.read();
+// requests one Response_Packet from the slave, bounded by a single I2C transaction.
+// Records whether the slave has consumed the last command and returns its state.
+// With telemetry the Telemetry_Packet behind the response is read in the same transaction.
+Communicator::Poll_Result::Poll_Result_Enum Communicator::_readResponse(Telemetry_Packet* telemetry)
+{
+	byte temp[Protocol::RESPONSE_LENGTH + Protocol::TELEMETRY_LENGTH];
+	uint8_t length = (telemetry) ? sizeof(temp) : Protocol::RESPONSE_LENGTH;
 
-	Response_Packet *rp = new Response_Packet(temp, true);
-	Serial.print("L: ");
-	Serial.print(_lastCommandID);
-	Serial.print("\tR: ");
-	Serial.println(rp->_id);
-	bool retval = rp->status && (_lastCommandID == rp->_id);
-	delete rp;
+	if(_wire.requestFrom(int(_slaveAddress), int(length)) < length)
+	{
+		// Slave missing or NACKed, drop whatever arrived.
+		while(_wire.available()) _wire.read();
+		return Poll_Result::Pending;
+	}
+
+	for(uint8_t i = 0 ; i < length ; i++)
+		temp[i] = _wire.read();
+
+	Response_Packet rp(temp, _debug);
+	if(!rp.valid)
+	{
+		_stats.corruptFrames++;
+		return Poll_Result::Pending;
+	}
+	_stats.framesReceived++;
+
+	if(telemetry)
+	{
+		Telemetry_Packet tp(&temp[Protocol::RESPONSE_LENGTH], _debug);
+		if(tp.valid)
+			*telemetry = tp;
+		else
+			_stats.corruptFrames++;
+	}
+
+	if(_debug)
+	{
+		Serial.print("L: ");
+		Serial.print(_lastCommandID);
+		Serial.print("\tR: ");
+		Serial.println(rp._id);
+	}
+	_responseVersion = rp.version;
+
+	if(_lastCommandID != rp._id)
+		_stats.idMismatches++;
+	else if(!_commandAcked)
+	{
+		// First acknowledge of the last command.
+		_stats.lastRoundTrip = micros() - _sendTime;
+		if(_stats.lastRoundTrip > _stats.maxRoundTrip)
+			_stats.maxRoundTrip = _stats.lastRoundTrip;
+		_stats.roundTrips.add(_stats.lastRoundTrip);
+	}
+	_commandAcked = (_lastCommandID == rp._id);
+
+	if(!_commandAcked || rp.inProgress) return Poll_Result::Pending;
+	return (rp.status) ? Poll_Result::Ok : Poll_Result::Error;
+}
+
+// polls the slave until it echoes the id of the last command or timeout (ms) expires
+bool Communicator::_awaitAck(uint16_t timeout)
+{
+	uint32_t start = millis();
+	while(!_commandAcked)
+	{
+		if(millis() - start >= timeout) return false;
+		_readResponse();
+	}
+	return true;
+}
+
+bool Communicator::recieveResponse()
+{
+	if(!_commandSent) return true;
+
+	bool retval = (_readResponse() == Poll_Result::Ok);
 	_commandSent = !retval;
 	return retval;
 }
+
+Communicator::Poll_Result::Poll_Result_Enum Communicator::pollResponse()
+{
+	if(_pollResult != Poll_Result::Pending) return _pollResult;
+
+	// The deadline ends with the acknowledge, a long move then stays in progress until it is done.
+	_pollResult = _readResponse();
+	if(_pollResult == Poll_Result::Pending && !_commandAcked && (micros() - _sendTime) >= _responseTimeout)
+	{
+		_stats.timeouts++;
+		_pollResult = Poll_Result::Timeout;
+	}
+	return _pollResult;
+}
+
+void Communicator::setResponseTimeout(uint32_t timeout)
+{
+	_responseTimeout = timeout;
+}
+
+bool Communicator::readTelemetry(Telemetry_Packet& telemetry)
+{
+	if(_version < 2) return false;
+
+	Telemetry_Packet tp;
+	_readResponse(&tp);
+	if(!tp.valid) return false;
+
+	telemetry = tp;
+	return true;
+}
+
+void Communicator::broadcast(TwoWire& wire, Command_Packet::Commands::Commands_Enum command, byte p0, byte p1, byte p2, byte p3, byte p4, byte p5)
+{
+	// Every slave has to be able to decode the frame, and none may take it for a retransmission.
+	uint8_t version = PROTOCOL_VERSION;
+	byte id = Protocol::BROADCAST_ID;
+
+	for(Communicator* ep = _endpoints ; ep ; ep = ep->_next)
+	{
+		if(&ep->_wire != &wire || ep->_version == 0) continue;
+		if(ep->_version < version) version = ep->_version;
+
+		// Everything queued for a slave was meant to run before the broadcast.
+		ep->_drainSubmitted();
+		ep->flushMotors();
+		if(ep->_batching) ep->_flushBatch();
+		if(ep->_flowControl) ep->_awaitAck();
+		ep->_pace();
+	}
+
+	byte packetBytes[Protocol::COMMAND_LENGTH];
+	Command_Packet(id, command, p0, p1, p2, p3, p4, p5).GetPacketBytes(packetBytes, version);
+	wire.beginTransmission(0);
+	wire.write(packetBytes, Protocol::COMMAND_LENGTH);
+	wire.endTransmission();
+
+	for(Communicator* ep = _endpoints ; ep ; ep = ep->_next)
+	{
+		if(&ep->_wire != &wire || ep->_version == 0) continue;
+		ep->_stats.framesSent++;
+		ep->_traceFrame(0, packetBytes, Protocol::COMMAND_LENGTH);		// Part of the stream every slave received.
+		ep->_sendTime = micros();
+		ep->_transmitted(id, ep->_maxRetries);		// Only waits for the acknowledge, a broadcast is never repeated.
+	}
+}
+
+void Communicator::broadcastStop(TwoWire& wire)
+{
+	broadcast(wire, Command_Packet::Commands::Stop);
+}
+
+Command_Handle Communicator::submit(Command_Packet::Commands::Commands_Enum command, byte p0, byte p1, byte p2, byte p3, byte p4, byte p5)
+{
+	Command_Handle handle;
+	if(_queued + (_inFlight != NO_SLOT) >= SUBMIT_QUEUE_DEPTH) return handle;
+
+	// The text of DrawText follows in Text Packets, which only drawText() sends.
+	if(command == Command_Packet::Commands::DrawText) return handle;
+
+	handle.ticket = ++_ticket;
+	handle.valid = true;
+
+	Submit_Slot& slot = _submitted[_ticket % SUBMIT_QUEUE_DEPTH];
+	slot.ticket = _ticket;
+	slot.command = command;
+	slot.parameter[0] = p0;
+	slot.parameter[1] = p1;
+	slot.parameter[2] = p2;
+	slot.parameter[3] = p3;
+	slot.parameter[4] = p4;
+	slot.parameter[5] = p5;
+	slot.result = Poll_Result::Pending;
+	_queued++;
+
+	// Goes out right away if nothing holds it back.
+	poll();
+	return handle;
+}
+
+void Communicator::poll()
+{
+	if(_inFlight != NO_SLOT)
+	{
+		Submit_Slot& slot = _submitted[_inFlight];
+		slot.result = pollResponse();
+		if(slot.result != Poll_Result::Pending)
+			_inFlight = NO_SLOT;
+		else if(_reliable && !_commandAcked && _attempt < _maxRetries && millis() - _attemptTime >= _retryTimeout(_attempt))
+		{
+			_stats.retries++;
+			_attempt++;
+			_writeSubmitted(slot, false);
+			return;
+		}
+	}
+
+	if(_queued == 0) return;
+	if(_holdOff && millis() - _transferTime < COMMAND_DELAY) return;
+	if(_inFlight != NO_SLOT)
+	{
+		if(!_released()) return;
+		_supersede();
+	}
+
+	// The oldest queued ticket, taken modulo 2^16 like the tickets themselves.
+	_inFlight = (uint16_t)(_ticket - _queued + 1) % SUBMIT_QUEUE_DEPTH;
+	_queued--;
+	_attempt = 0;
+	_writeSubmitted(_submitted[_inFlight], true);
+}
+
+Communicator::Poll_Result::Poll_Result_Enum Communicator::status(const Command_Handle& handle)
+{
+	if(!handle.valid) return Poll_Result::Error;
+
+	const Submit_Slot& slot = _submitted[handle.ticket % SUBMIT_QUEUE_DEPTH];
+	if(slot.ticket != handle.ticket) return Poll_Result::Timeout;
+	return slot.result;
+}
+
+// writes a submitted command to the bus, a single transfer that never waits
+void Communicator::_writeSubmitted(Submit_Slot& slot, bool first)
+{
+	Command_Packet cp((first) ? _nextCommandID() : _lastCommandID, slot.command,
+		slot.parameter[0], slot.parameter[1], slot.parameter[2], slot.parameter[3], slot.parameter[4], slot.parameter[5]);
+
+	_writeCommand(cp, _version);
+	_markSent(cp._id, _attempt);
+	_attemptTime = millis();
+}
+
+// true once the command in flight no longer holds back the next one, by the same rules as sendCommand()
+bool Communicator::_released()
+{
+	if(_commandAcked || (!_flowControl && !_reliable)) return true;
+	if(_reliable)
+		return _attempt >= _maxRetries && millis() - _attemptTime >= _retryTimeout(_attempt);
+	return millis() - _attemptTime >= ACK_TIMEOUT;
+}
+
+// transmits all submitted commands before a blocking transfer takes over the slave
+void Communicator::_drainSubmitted()
+{
+	while(_queued > 0) poll();
+	if(_inFlight == NO_SLOT) return;
+
+	if(_flowControl) _awaitAck();
+	_supersede();
+}
+
+// settles the command in flight before the next transfer, its final status is never read
+void Communicator::_supersede()
+{
+	if(!_commandAcked) _stats.timeouts++;
+	_submitted[_inFlight].result = (_commandAcked) ? Poll_Result::Ok : Poll_Result::Timeout;
+	_inFlight = NO_SLOT;
+}
@@ -11,110 +11,84 @@
 #include "Arduino.h"
 #include "Wire.h"
 
+#include "Protocol.h"
+
 #define FORWARD 1
 #define REVERSE 0
 #define STOP 103
 #define LEFT 1
 #define RIGHT 0
 
-/**
- * Command Packet Structure:
- * Byte 1: Start Byte - Always 0x55
- * Byte 2: An random generated ID for the Command, same ID is sent in response.
- * Byte 3: Command Byte - Identifies Command
- * Byte 4-9: Parameters - Varies from Command to Command
- * Byte 10: End Byte - Always 0x99
- */
+/** Command to be sent to the slave, see Command Packet Structure in Protocol.h. */
 class Command_Packet
 {
 	public:
-		// Declaring Enums inside an embedded class or struct does not pollute Global/Class Scope
-		class Commands
-		{
-			public:
-				enum Commands_Enum
-				{
-					NotSet				= 0x00,		// Default value for enum. Slave will return error if sent this.
-					DrawPoint			= 0x10,		// Draw Point on OLED.
-					DrawLine			= 0x12,		// Draw Line on OLED.
-					DrawCircle			= 0x13,		// Draw Circle on OLED.
-					DrawDisc 			= 0x14,		// Draw Filled Disc on OLED.
-					DrawTriangle		= 0x15,		// Draw Circle on OLED.
-					DrawRectangle		= 0x16,		// Draw Rectangle on OLED.
-					DrawBox 			= 0x17,		// Draw Filed Box on OLED.
-                    DrawText            = 0x18,     // Displays text on the OLED.
-                    ClearScreen         = 0x19,     // Clears the Screen
-                    LeftMotor           = 0x31,     // Move Left Motor.
-                    RightMotor          = 0x32,     // Move Right Motor.
-                    Move                = 0x33,     // Move the complete Bot.
-                    MoveDistance        = 0x34,     // Move the complete Bot for a Given Distance.
-                    Stop                = 0x35,
-                    TurnAngle		    = 0x36,
-                    Turn		        = 0x37,
-			};
-		};
+		typedef Protocol::Commands Commands;			// Command bytes shared with the slave, see Protocol.h
 	
 		byte _id;										// An unique id for each new command.	
-		byte Parameter[6];								// Parameter 6 bytes, changes meaning depending on command							
+		byte Parameter[Protocol::PARAMETER_COUNT];		// Parameter 6 bytes, changes meaning depending on command							
 		Commands::Commands_Enum _command;	
-		byte* GetPacketBytes();							// returns the bytes to be transmitted
+		void GetPacketBytes(byte* out, uint8_t version) const;		// fills out with the COMMAND_LENGTH bytes to be transmitted
+		void WriteBatchEntry(byte* entry) const;		// writes the 7 byte batch entry (command + parameters) into entry
 		//void ParameterFromInt(int i);
 
-		Command_Packet(byte id, Commands::Commands_Enum command);
-
-	private: 
-		static const byte COMMAND_START_CODE = 0x55;	// Static byte to mark the beginning of a command packet	-	never changes
-		static const byte COMMAND_END_CODE = 0x99;		// Static byte to mark the end of a command packet	-	never changes
-
-		// word _CalculateChecksum();						// Checksum is calculated using byte addition
-		// byte GetHighByte(word w);						
-		// byte GetLowByte(word w);
+		Command_Packet(byte id, Commands::Commands_Enum command, byte p0 = 0, byte p1 = 0, byte p2 = 0, byte p3 = 0, byte p4 = 0, byte p5 = 0);
 };
 
 //	----------------------------------------------------------------------------------
 
-/**
- * Response Packet Structure:
- * Byte 1: Start Byte - Always 0xAA
- * Byte 2: The Command ID sent by Master.
- * Byte 3: Status - OK or ERROR
- * Byte 4: End Byte - Always 0x11
- */
+/** Response read from the slave, see Response Packet Structure in Protocol.h. */
 class Response_Packet
 {
 	public:
 		bool status;									// Status of Command.
+		bool inProgress;								// Command accepted but still executing.
+		bool valid;										// false if framing or CRC-8 is corrupt.
+		uint8_t version;								// Protocol version the slave answered with.
 		byte _id;			
 
 		Response_Packet(byte* buffer, bool UseSerialDebug);
-		bool CheckParsing(byte b, byte propervalue, char* varname, bool UseSerialDebug);
-
-	private: 
-		static const byte RESPONSE_START_CODE = 0xAA;	// Static byte to mark the beginning of a command packet	-	never changes
-		static const byte RESPONSE_END_CODE = 0x11;		// Static byte to mark the end of a command packet	-	never changes
-		static const byte OK = 0x50;
-		static const byte ERROR = 0x51;
+		bool CheckParsing(byte b, byte propervalue, const char* varname, bool UseSerialDebug);
 };
 
 //	----------------------------------------------------------------------------------
 
-/**
- * Data Packet Structure:
- * Byte 1: Start Byte - Always 0xDD
- * Byte 2-19: Data
- * Byte 20: End Byte - Always 0xAA
- */
+/** Text for version 1 slaves, see Data Packet Structure in Protocol.h. Version 2 slaves get Text Packets. */
 class Data_Packet
 {
 	public:
 		byte _id;			
 
 		Data_Packet(char* str);
-        	char data[20];
+        	char data[Protocol::DATA_LENGTH];
+};
 
-	private: 
-		static const byte DATA_START_CODE = 0xDD;	// Static byte to mark the beginning of a command packet	-	never changes
-		static const byte DATA_END_CODE = 0xAA;		// Static byte to mark the end of a command packet	-	never changes
+//	----------------------------------------------------------------------------------
+
+/** Bus health statistics of the master. */
+struct Link_Stats
+{
+	uint16_t framesSent;								// Packets written to the bus, retransmissions included.
+	uint16_t framesReceived;							// Valid Response Packets read.
+	uint16_t corruptFrames;								// Responses rejected because of bad framing or CRC-8.
+	uint16_t idMismatches;								// Valid responses echoing another id than the last command, i.e. not consumed yet.
+	uint16_t retries;									// Retransmissions after a missing acknowledge.
+	uint16_t timeouts;									// Commands given up by the reliable mode or pollResponse().
+	uint32_t lastRoundTrip;								// First transmission to acknowledge of the last command, in us.
+	uint32_t maxRoundTrip;								// Largest round trip seen so far, in us.
+	Latency_Histogram roundTrips;						// All round trips, in us.
+};
+
+//	----------------------------------------------------------------------------------
+
+/** Handle of a command queued by Communicator::submit(), see Communicator::status(). */
+class Command_Handle
+{
+	public:
+		uint16_t ticket;								// Running number of the submitted command.
+		bool valid;										// false if the command was rejected because the queue was full.
+
+		Command_Handle(): ticket(0), valid(false) {}
 };
 
 //	----------------------------------------------------------------------------------
@@ -122,12 +96,210 @@ class Data_Packet
 class Communicator
 {
 	public:
-		Communicator();
-		void begin(uint8_t);
-		void sendCommand(byte*);
-        void sendData(byte*);
+		// Declaring Enums inside an embedded class or struct does not pollute Global/Class Scope
+		class Poll_Result
+		{
+			public:
+				enum Poll_Result_Enum
+				{
+					Pending,							// No matching response yet, or the slave is still executing the command.
+					Ok,									// The slave executed the command successfully.
+					Error,								// The slave rejected or failed the command.
+					Timeout,							// The slave did not acknowledge the command within the response timeout.
+				};
+		};
+
+		/** Constructor for the master Communicator.
+         *
+         *  @param wire The I2C bus to talk to the slave on. The host build in test/ links a simulated Wire library instead.
+         */
+		Communicator(TwoWire& wire = Wire);
+		~Communicator();
+
+		/** Joins the bus as master and negotiates the protocol version with the slave.
+         *
+         *  The slave has to be listening by then. A slave that does not answer at all is
+         *  driven with version 1 like one that predates version 2, after up to about 1 s of
+         *  probing. If the slave may boot later than the master, call negotiate() once it is up.
+         *
+         *  @param slaveAddress I2C address of the slave.
+         *  @param clock        Bus clock in Hz, 100 kHz by default, 400 kHz for fast mode.
+         */
+		void begin(uint8_t, uint32_t clock = 100000);
+		void sendCommand(const Command_Packet&);
+        void sendData(const Data_Packet&);
 		bool recieveResponse();
 
+		/** Non-blocking check for the response to the last command or batch.
+         *
+         *  Costs at most one 4 byte I2C read. Once the result is Ok, Error or Timeout it is
+         *  returned again without bus traffic until the next command is sent.
+         *
+         *  @return Pending, Ok, Error or Timeout.
+         */
+		Poll_Result::Poll_Result_Enum pollResponse();
+
+		/** Queues a command without blocking, it is transmitted by poll().
+         *
+         *  Submitted commands go out in order and are paced like sendCommand() paces them,
+         *  but no call ever waits for the bus, the slave or the hold-off. Neither batching
+         *  nor motor coalescing applies to them. The blocking command methods send all
+         *  submitted commands first. DrawText is refused, its text is only sent by drawText().
+         *
+         *  @param command The command, followed by its parameters.
+         *
+         *  @return Handle for status(), invalid if SUBMIT_QUEUE_DEPTH commands are still pending or the command is DrawText.
+         */
+		Command_Handle submit(Command_Packet::Commands::Commands_Enum, byte = 0, byte = 0, byte = 0, byte = 0, byte = 0, byte = 0);
+
+		/** Progresses submitted commands, call it on every pass of the main loop.
+         *
+         *  Costs at most one I2C transfer: either the response read of the command in flight,
+         *  a retransmission in reliable mode or the transmission of the next queued command.
+         */
+		void poll();
+
+		/** State of a submitted command.
+         *
+         *  A command that is superseded by the next one before the slave reported a final status
+         *  reports Ok if the slave consumed it, Timeout otherwise.
+         *  Handles older than the last SUBMIT_QUEUE_DEPTH commands also report Timeout.
+         *
+         *  @param handle Returned by submit().
+         *
+         *  @return Pending while queued or executing, then Ok, Error or Timeout.
+         */
+		Poll_Result::Poll_Result_Enum status(const Command_Handle&);
+
+		/** true if no submitted command is queued or waiting for its result. */
+		bool idle() { return _queued == 0 && _inFlight == NO_SLOT; }
+
+		/** Sets the deadline for pollResponse(), counted from the first transmission of the command.
+         *
+         *  The deadline only applies until the slave acknowledges the command. A command it reports
+         *  in progress, e.g. a long MoveMillimeters, stays Pending until it is done.
+         *
+         *  @param timeout Deadline in microseconds, 500 ms by default.
+         */
+		void setResponseTimeout(uint32_t);
+
+		/** Selects how the master paces consecutive commands.
+         *
+         *  With flow control disabled (default) the next transfer to the same slave waits until 30 ms
+         *  have passed since the previous one. Transfers to other slaves are not held up by it.
+         *  With flow control enabled the next command is sent as soon as the slave's Response_Packet
+         *  echoes the id of the previous one, i.e. as soon as the slave has consumed it.
+         *
+         *  @param enable true for ACK-driven flow control, false for the fixed delay.
+         */
+		void setFlowControl(bool);
+
+		/** Enables the reliable-send mode.
+         *
+         *  Every command and batch is retransmitted with exponential backoff (4, 8, 16, ... ms)
+         *  until the slave echoes its id or the retry budget runs out.
+         *  The slave drops retransmissions of a packet it already received.
+         *
+         *  @param enable  true for reliable sends, false for fire-and-forget.
+         *  @param retries Retransmissions per command before it is counted as a timeout.
+         */
+		void setReliable(bool, uint8_t retries = 3);
+
+		/** Frame, error, retry, timeout and round trip statistics since begin(). */
+		const Link_Stats& stats() { return _stats; }
+
+		/** Prints the statistics and the round trip histogram, e.g. to Serial. */
+		void printStats(Print& out = Serial);
+
+		/** Enables printing of every response and of parsing errors to Serial. Off by default.
+         *
+         *  @param enable true to print, false to stay quiet.
+         */
+		void setDebug(bool);
+
+		/** Protocol version negotiated with the slave in begin() or negotiate().
+         *
+         *  Version 2 frames carry a CRC-8, slaves that do not answer the version 2 probe are driven with version 1.
+         */
+		uint8_t protocolVersion() { return _version; }
+
+		/** Negotiates the protocol version again, e.g. after the slave booted or was reset.
+         *
+         *  Sends the pending and submitted commands first, then probes the slave like begin().
+         *  Blocks until the slave answers, or up to about 1 s before falling back to version 1.
+         *
+         *  @return The protocol version now used, see protocolVersion().
+         */
+		uint8_t negotiate();
+
+		/** Reads the slave's latest telemetry snapshot in the same transfer as its response.
+         *
+         *  Costs a single 24 byte I2C read and no command, so it can be called at the navigation loop rate.
+         *  The response part is processed like pollResponse() does.
+         *
+         *  @param telemetry Receives the snapshot, left untouched if false is returned.
+         *
+         *  @return false if the slave speaks version 1 or the telemetry is corrupt.
+         */
+		bool readTelemetry(Telemetry_Packet&);
+
+		/** Sends one command to every slave on the bus at once, through the I2C general call address.
+         *
+         *  Meant for synchronized start and stop of several nodes. Every Communicator on the bus
+         *  takes the broadcast as its last command, so pollResponse() reports each slave's result.
+         *  The command is encoded in the lowest protocol version of these slaves and is not retransmitted.
+         *  It carries Protocol::BROADCAST_ID, so no slave drops it as a retransmission.
+         *
+         *  @param wire    The I2C bus of the slaves.
+         *  @param command The command, followed by its parameters.
+         */
+		static void broadcast(TwoWire& wire, Command_Packet::Commands::Commands_Enum, byte = 0, byte = 0, byte = 0, byte = 0, byte = 0, byte = 0);
+
+		/** Stops every Bot on the bus at once, see broadcast(). */
+		static void broadcastStop(TwoWire& wire = Wire);
+
+		/** Records every frame written to the slave into a compact binary trace.
+         *
+         *  Commands, batches, data and text frames are logged with a timestamp, see Trace Record
+         *  Structure in Protocol.h, e.g. to an SD card file or a second serial port.
+         *  test/replay plays a trace back into a slave on the host. begin() stops tracing.
+         *
+         *  @param out Sink of the trace records, NULL (default) stops tracing.
+         */
+		void setTrace(Print* out = NULL);
+
+		/** Number of responses rejected because of bad framing or CRC-8. */
+		uint16_t corruptFrames() { return _stats.corruptFrames; }
+
+		/** Starts collecting commands into batch packets instead of sending them one by one.
+         *
+         *  Every command issued until EndBatch() is packed into as few transfers as the Wire buffer allows.
+         *  The slave executes them in order and answers each batch with a single Response_Packet.
+         */
+		void BeginBatch();
+
+		/** Sends the pending batch packet, if any, and returns to sending commands one by one. */
+		void EndBatch();
+
+		/** Enables coalescing of motor setpoints.
+         *
+         *  leftMotor(), rightMotor(), move() and turn() then only update the pending setpoint of each motor.
+         *  A setpoint superseded before it is sent never reaches the bus. The pending setpoints are sent
+         *  at most once per interval, with left and right fused into a single Drive command.
+         *  Any other command sends them first, so the order of commands is kept.
+         *
+         *  @param enable   true to coalesce motor setpoints, false to send every call.
+         *  @param interval Least time between two motor transfers in ms, 30 ms by default.
+         */
+		void setCoalescing(bool, uint16_t interval = COALESCE_INTERVAL);
+
+		/** Sends the pending motor setpoints now. Call it from loop() so that the last setpoint of a
+         *  burst is sent without waiting for the next motor call.
+         *
+         *  @param force false to send only once the coalescing interval has passed.
+         */
+		void flushMotors(bool force = true);
+
 		/** Sends command to draw a Line on OLED Display.
          *  
          *  @param x x-coordinate of the pixel.
@@ -226,30 +398,128 @@ class Communicator
 
         /** Sends command to move the Bot at given speed.
          *  @param dir      Direction of Movement, values = {FORWARD, REVERSE, STOP}
-         *  @param speed    speed of the motor, range: (0-255)
+         *  @param speed    speed of the motor in percent, range: (0-100), sent as PWM 0-255
          *
          */   
         void move(uint8_t, uint8_t);
 
         /** Sends command to move the Bot for given distance.
          *
-         *@param cm Distance to be travelled in centi-meters, range: (0-255)
+         *@param cm    Distance to be travelled in centi-meters, range: (0-255)
+         *@param dir   0 moves backwards, anything else forwards
+         *@param speed Travel speed in cm/s, 0 leaves it to the slave. Ignored by version 1 slaves.
          *
          */    
         void moveDistance(uint8_t, uint8_t, uint8_t);
+
+        /** Sends command to move the Bot for given distance with millimetre resolution.
+         *
+         *  Version 1 slaves get a MoveDistance command limited to 255 cm instead.
+         *
+         *  @param mm    Distance to be travelled in mm, negative moves backwards. The slave answers ERROR beyond 32 m.
+         *  @param speed Travel speed in mm/s, 0 leaves it to the slave.
+         *
+         */
+        void moveMillimeters(int32_t, uint16_t speed = 0);
         
 	void turn(uint8_t, uint8_t);
 
+        /** Sends command to turn the Bot by given angle.
+         *
+         *@param degree Angle in degree, range: (0-255)
+         *@param dir    1 turns counter-clockwise, anything else clockwise
+         *@param speed  Turn rate in degree/s, 0 leaves it to the slave. Ignored by version 1 slaves.
+         *
+         */
 	void turnAngle(uint8_t degree, uint8_t dir, uint8_t speed);
 
+        /** Sends command to turn the Bot by given angle with 1/100 degree resolution.
+         *
+         *  Version 1 slaves get a TurnAngle command in whole degrees instead.
+         *
+         *  @param centidegrees Angle in 1/100 degree, positive turns clockwise. The slave answers ERROR
+         *                      if the wheels would travel more than 32 m, about 3700 degree.
+         *  @param speed        Turn rate in degree/s, 0 leaves it to the slave.
+         *
+         */
+        void turnCentidegrees(int32_t, uint16_t speed = 0);
+
 
         /** Sends command to Stop the Bot.
          *         *
          */    
         void stop();
 	private:
-		uint8_t _slaveAddress, _lastCommandID;
-        bool _commandSent;
+		static const uint8_t COMMAND_DELAY = 30;		// Least time between two transfers to the slave when flow control is disabled, in ms.
+		static const uint16_t ACK_TIMEOUT = 500;		// Upper bound for waiting on the slave to consume a command, in ms.
+		static const uint8_t VERSION_PROBES = 10;		// Version 2 probes sent by begin() before falling back to version 1.
+		static const uint16_t VERSION_TIMEOUT = 100;	// Time to wait for the answer to one probe, in ms.
+		static const uint32_t RESPONSE_TIMEOUT = 500000;	// Default deadline of pollResponse(), in us.
+		static const uint16_t COALESCE_INTERVAL = COMMAND_DELAY;	// Default least time between two coalesced motor transfers, in ms.
+		static const uint16_t RETRY_TIMEOUT = 4;		// Acknowledge timeout of the first transmission, doubled per retry up to ACK_TIMEOUT, in ms.
+		static const uint8_t SUBMIT_QUEUE_DEPTH = 8;	// Submitted commands queued or in flight at a time.
+		static const uint8_t NO_SLOT = 0xFF;
+
+		/** A submitted command and its result. */
+		struct Submit_Slot
+		{
+			uint16_t ticket;
+			Command_Packet::Commands::Commands_Enum command;
+			byte parameter[Protocol::PARAMETER_COUNT];
+			Poll_Result::Poll_Result_Enum result;
+		};
+
+		static Communicator* _endpoints;				// All master Communicators, one per slave, linked through _next.
+		Communicator* _next;
+
+		TwoWire& _wire;
+		uint8_t _slaveAddress, _lastCommandID, _sequence;
+		uint8_t _version, _responseVersion;
+        bool _commandSent, _commandAcked, _flowControl, _batching, _reliable, _debug;
+		uint8_t _maxRetries;
+		uint32_t _sendTime, _responseTimeout;
+		Print* _trace;
+		bool _holdOff;									// The slave may still be busy with the last transfer.
+		uint32_t _transferTime;							// Last transfer to the slave, in ms.
+		Poll_Result::Poll_Result_Enum _pollResult;
+		Link_Stats _stats;
+
+		Submit_Slot _submitted[SUBMIT_QUEUE_DEPTH];		// Ring indexed by ticket, see submit().
+		uint16_t _ticket;								// Ticket of the last submitted command.
+		uint8_t _queued;								// Submitted commands not transmitted yet.
+		uint8_t _inFlight;								// Slot of the transmitted command waiting for its result, or NO_SLOT.
+		uint8_t _attempt;								// Retransmissions of the command in flight.
+		uint32_t _attemptTime;							// Last transmission of the command in flight, in ms.
+
+		bool _coalescing;
+		bool _leftPending, _rightPending;				// A motor setpoint is waiting to be sent.
+		uint8_t _leftDir, _leftSpeed, _rightDir, _rightSpeed;	// Latest motor setpoints.
+		uint16_t _coalesceInterval;
+		uint32_t _motorTime;							// Last transfer of motor setpoints, in ms.
+
+		byte _batch[WIRE_BUFFER_LENGTH];				// Entries of the pending batch, see Batch Packet Structure.
+		uint8_t _batchLength, _batchCount;
+
+		byte _nextCommandID();
+		void _setMotors(bool left, uint8_t leftDir, uint8_t leftSpeed, bool right, uint8_t rightDir, uint8_t rightSpeed);
+		void _sendCommand(Command_Packet::Commands::Commands_Enum, byte = 0, byte = 0, byte = 0, byte = 0, byte = 0, byte = 0);
+		Poll_Result::Poll_Result_Enum _readResponse(Telemetry_Packet* telemetry = NULL);
+		bool _awaitAck(uint16_t timeout = ACK_TIMEOUT);
+		static uint16_t _retryTimeout(uint8_t attempt);
+		void _negotiateVersion();
+		void _flushBatch();
+		void _sendText(const char*);
+		bool _transmitted(byte id, uint8_t attempt);
+		void _pace();
+		void _paced();
+		void _markSent(byte id, uint8_t attempt);
+		void _writeSubmitted(Submit_Slot&, bool first);
+		bool _released();
+		void _drainSubmitted();
+		void _supersede();
+		void _writeCommand(const Command_Packet&, uint8_t version);
+		void _transfer(const byte* frame, uint8_t length);
+		void _traceFrame(uint8_t address, const byte* frame, uint8_t length);
 };
 
 #endif
@@ -0,0 +1,250 @@
+/**
+ *  Packet definitions shared by the Master and Slave Communicator.
+ *
+ *  Both sides include this header, so command bytes, start and end codes and
+ *  frame layouts can never diverge between the two processors.
+ *
+ *  @author Siddhesh Nachane
+ *  @version 0.9 04-07-2017
+ */
+
+#ifndef Protocol_h
+#define Protocol_h
+
+#include "Arduino.h"
+#include "Wire.h"
+
+// Largest single transfer the Wire library can buffer.
+#ifdef BUFFER_LENGTH
+	#define WIRE_BUFFER_LENGTH BUFFER_LENGTH
+#else
+	#define WIRE_BUFFER_LENGTH 32
+#endif
+
+// Highest protocol version understood by this library, see Command Packet Structure.
+#define PROTOCOL_VERSION 2
+
+class Protocol
+{
+	public:
+		// Declaring Enums inside an embedded class or struct does not pollute Global/Class Scope
+		class Commands
+		{
+			public:
+				enum Commands_Enum
+				{
+					NotSet				= 0x00,		// Default value for enum. Slave will return error if sent this.
+					Version				= 0x01,		// Protocol version probe, Parameter 1 holds the master's version.
+					DrawPoint			= 0x10,		// Draw Point on OLED.
+					DrawLine			= 0x12,		// Draw Line on OLED.
+					DrawCircle			= 0x13,		// Draw Circle on OLED.
+					DrawDisc 			= 0x14,		// Draw Filled Disc on OLED.
+					DrawTriangle		= 0x15,		// Draw Triangle on OLED.
+					DrawRectangle		= 0x16,		// Draw Rectangle on OLED.
+					DrawBox 			= 0x17,		// Draw Filled Box on OLED.
+					DrawText			= 0x18,		// Displays text on the OLED.
+					ClearScreen			= 0x19,		// Clears the Screen
+					LeftMotor			= 0x31,		// Move Left Motor.
+					RightMotor			= 0x32,		// Move Right Motor.
+					Move				= 0x33,		// Move the complete Bot.
+					MoveDistance		= 0x34,		// Move the complete Bot for a Given Distance.
+					Stop				= 0x35,		// Stop the Bot.
+					TurnAngle			= 0x36,		// Turn the Bot by a Given Angle.
+					Turn				= 0x37,		// Turn the Bot in place.
+					Drive				= 0x38,		// Set both Motors, direction and speed of the left then the right Motor.
+					MoveMillimeters		= 0x39,		// Move the complete Bot for a Given Distance, see Fixed-point Parameters.
+					TurnCentidegrees	= 0x3A,		// Turn the Bot by a Given Angle, see Fixed-point Parameters.
+				};
+		};
+
+		// Start and end bytes	-	never change
+		static const byte COMMAND_START_CODE = 0x55;
+		static const byte COMMAND_START_CODE_V2 = 0x56;
+		static const byte COMMAND_END_CODE = 0x99;
+		static const byte BATCH_START_CODE = 0xBB;
+		static const byte BATCH_START_CODE_V2 = 0xBC;
+		static const byte BATCH_END_CODE = 0x99;
+		static const byte RESPONSE_START_CODE = 0xAA;
+		static const byte RESPONSE_START_CODE_V2 = 0xAB;
+		static const byte RESPONSE_END_CODE = 0x11;
+		static const byte DATA_START_CODE = 0xDD;
+		static const byte DATA_END_CODE = 0xAA;
+		static const byte TEXT_START_CODE = 0xDE;
+		static const byte TELEMETRY_START_CODE = 0xEE;
+
+		// Response status
+		static const byte OK = 0x50;
+		static const byte ERROR = 0x51;
+		static const byte IN_PROGRESS = 0x52;
+
+		// Sequence number of broadcasts, never given to any other packet
+		static const byte BROADCAST_ID = 0x00;
+
+		// Frame layouts, in bytes
+		static constexpr uint8_t PARAMETER_COUNT = 6;
+		static constexpr uint8_t COMMAND_LENGTH = 3 + PARAMETER_COUNT + 1;		// Start, ID, Command, Parameters, End.
+		static constexpr uint8_t RESPONSE_LENGTH = 4;							// Start, ID, Status, End.
+		static constexpr uint8_t BATCH_HEADER_SIZE = 3;						// Start, ID and Count.
+		static constexpr uint8_t BATCH_ENTRY_SIZE = 1 + PARAMETER_COUNT;		// Command byte + Parameters.
+		static constexpr uint8_t BATCH_MAX_COMMANDS = (WIRE_BUFFER_LENGTH - BATCH_HEADER_SIZE - 1) / BATCH_ENTRY_SIZE;
+		static constexpr uint8_t TEXT_HEADER_SIZE = 3;							// Start, Length and More.
+		static constexpr uint8_t TEXT_CHUNK_LENGTH = WIRE_BUFFER_LENGTH - TEXT_HEADER_SIZE - 1;
+		static constexpr uint8_t DATA_LENGTH = 20;
+		static constexpr uint8_t TELEMETRY_LENGTH = 20;
+		static constexpr uint8_t MIN_PACKET_LENGTH = TEXT_HEADER_SIZE + 1;		// Shortest packet, an empty Text Packet.
+		static constexpr uint8_t TRACE_HEADER_SIZE = 6;						// Time, Address and Length, see Trace Record Structure.
+
+		static_assert(COMMAND_LENGTH == 10, "Command Packet layout changed");
+		static_assert(DATA_LENGTH <= WIRE_BUFFER_LENGTH, "Data Packet does not fit the Wire buffer");
+		static_assert(BATCH_MAX_COMMANDS >= 1, "Batch Packet does not fit the Wire buffer");
+		static_assert(RESPONSE_LENGTH + TELEMETRY_LENGTH <= WIRE_BUFFER_LENGTH, "Response and Telemetry Packet do not fit the Wire buffer");
+		static_assert(MIN_PACKET_LENGTH <= RESPONSE_LENGTH && MIN_PACKET_LENGTH <= COMMAND_LENGTH, "MIN_PACKET_LENGTH must not exceed any packet");
+
+		/**
+		 * Command Packet Structure:
+		 * Byte 1: Start Byte - Always 0x55 (version 1) or 0x56 (version 2)
+		 * Byte 2: Sequence number of the Command, same ID is sent in response.
+		 * Byte 3: Command Byte - Identifies Command
+		 * Byte 4-9: Parameters - Varies from Command to Command
+		 * Byte 10: End Byte - Always 0x99 (version 1) or CRC-8 of Bytes 2-9 (version 2)
+		 *
+		 * The slave answers in the version of the last valid packet it received.
+		 * BROADCAST_ID marks a broadcast, the slave never drops one as a retransmission.
+		 */
+
+		/**
+		 * Batch Packet Structure:
+		 * Byte 1: Start Byte - Always 0xBB (version 1) or 0xBC (version 2)
+		 * Byte 2: Sequence number of the whole Batch, same ID is sent in response.
+		 * Byte 3: Count - Number of commands in the batch
+		 * Byte 4..: Count entries of 7 bytes - Command Byte followed by its 6 Parameters
+		 * Last Byte: End Byte - Always 0x99 (version 1) or CRC-8 of all bytes but the first and last (version 2)
+		 *
+		 * A batch never exceeds WIRE_BUFFER_LENGTH bytes, i.e. BATCH_MAX_COMMANDS commands.
+		 * The slave executes the commands in order and answers with a single Response Packet.
+		 */
+
+		/**
+		 * Response Packet Structure:
+		 * Byte 1: Start Byte - Always 0xAA (version 1) or 0xAB (version 2)
+		 * Byte 2: The Command ID sent by Master.
+		 * Byte 3: Status - OK, ERROR or IN_PROGRESS
+		 * Byte 4: End Byte - Always 0x11 (version 1) or CRC-8 of Bytes 2-3 (version 2)
+		 *
+		 * IN_PROGRESS is reported while commands of the same packet are still queued or executing,
+		 * and while the MOVE_TO / TURN_ANGLE motion started by the packet is running.
+		 */
+
+		/**
+		 * Data Packet Structure (version 1):
+		 * Byte 1: Start Byte - Always 0xDD
+		 * Byte 2-19: Data - NUL terminated text, at most 17 characters
+		 * Byte 20: End Byte - Always 0xAA
+		 */
+
+		/**
+		 * Text Packet Structure (version 2):
+		 * Byte 1: Start Byte - Always 0xDE
+		 * Byte 2: Length - Number of text bytes in this chunk, at most WIRE_BUFFER_LENGTH - 4
+		 * Byte 3: More - 1 if further chunks of the same text follow, 0 for the last chunk
+		 * Byte 4..: Length bytes of text, not NUL terminated
+		 * Last Byte: CRC-8 of all bytes but the first and last
+		 *
+		 * Replaces the Data Packet: text of any length is streamed in as many chunks as needed,
+		 * short text costs only its own length plus 4 bytes. The slave reassembles the chunks for
+		 * the preceding DrawText command. A text arriving before the previous one is drawn is
+		 * refused, its DrawText then reports ERROR.
+		 */
+
+		/**
+		 * Telemetry Packet Structure (version 2):
+		 * Byte 1: Start Byte - Always 0xEE
+		 * Byte 2: Sample - Incremented with every new snapshot, tells the master whether the data is fresh
+		 * Byte 3: Motion mode - 0 (STOP), 1 (MOVE_TO), 2 (ROTATE_TO) or 3 (WHEEL_OMEGA)
+		 * Byte 4-7: Left encoder position in counts, signed, little endian
+		 * Byte 8-11: Right encoder position in counts, signed, little endian
+		 * Byte 12-13: Left wheel omega in 0.01 rad/s, signed, little endian
+		 * Byte 14-15: Right wheel omega in 0.01 rad/s, signed, little endian
+		 * Byte 16-17: Left motor PID output (PWM), signed, little endian
+		 * Byte 18-19: Right motor PID output (PWM), signed, little endian
+		 * Byte 20: CRC-8 of Bytes 2-19
+		 *
+		 * The slave appends it to every version 2 Response Packet, so the master gets both in a single read.
+		 */
+
+		/**
+		 * Fixed-point Parameters (MoveMillimeters, TurnCentidegrees):
+		 * Parameter 1-4: Distance in mm or angle in 1/100 degree, signed 32 bit, little endian
+		 * Parameter 5-6: Speed in mm/s or degree/s, unsigned 16 bit, little endian - 0 leaves it to the slave
+		 *
+		 * Positive distances move forward, positive angles turn clockwise.
+		 * The slave answers ERROR for moves and turns beyond Motion::MAX_DISTANCE_MM of wheel travel.
+		 */
+
+		/**
+		 * Trace Record Structure (Master::Communicator::setTrace):
+		 * Byte 1-4: Time of the transfer in us (micros() of the master), unsigned 32 bit, little endian
+		 * Byte 5: I2C address the frame was written to, 0 for broadcasts
+		 * Byte 6: Length N of the frame
+		 * Byte 7..: The N bytes of the frame exactly as written to the bus
+		 *
+		 * A trace is a plain sequence of records. Feeding the frames of one slave address to a
+		 * Slave Communicator in order reproduces the command stream that slave received.
+		 */
+
+		/** Little endian fixed-point fields, used by parameters and telemetry. */
+		static void writeInt16(byte* out, int16_t value);
+		static void writeInt32(byte* out, int32_t value);
+		static int16_t readInt16(const byte* in);
+		static int32_t readInt32(const byte* in);
+
+		/** CRC-8, polynomial x^8 + x^2 + x + 1 (0x07), used by version 2 packets. */
+		static byte crc8Update(byte crc, byte b);
+		static byte crc8(const byte* data, uint8_t length);
+};
+
+/** Snapshot of the slave's motion state, encoded by the slave and decoded by the master, see Telemetry Packet Structure. */
+class Telemetry_Packet
+{
+	public:
+		bool valid;										// false if framing or CRC-8 is corrupt, or nothing was decoded yet.
+		uint8_t sample;									// Snapshot counter of the slave.
+		uint8_t mode;									// Motion mode of the slave.
+		int32_t posL, posR;								// Encoder positions in counts.
+		float omegaL, omegaR;							// Wheel omega in rad/s, sent in 0.01 rad/s.
+		int16_t pwmL, pwmR;								// Motor PID outputs.
+
+		Telemetry_Packet(): valid(false), sample(0), mode(0), posL(0), posR(0), omegaL(0), omegaR(0), pwmL(0), pwmR(0) {}
+		Telemetry_Packet(const byte* buffer, bool UseSerialDebug);	// decodes TELEMETRY_LENGTH bytes
+		void GetPacketBytes(byte* out) const;			// writes the TELEMETRY_LENGTH bytes to be transmitted into out
+
+	private:
+		// Byte offsets, see Telemetry Packet Structure.
+		static const uint8_t SAMPLE = 1;
+		static const uint8_t MODE = 2;
+		static const uint8_t POS_L = 3;
+		static const uint8_t POS_R = 7;
+		static const uint8_t OMEGA_L = 11;
+		static const uint8_t OMEGA_R = 13;
+		static const uint8_t PWM_L = 15;
+		static const uint8_t PWM_R = 17;
+		static const uint8_t CRC = 19;
+		static_assert(CRC == Protocol::TELEMETRY_LENGTH - 1, "Telemetry Packet layout changed");
+};
+
+/**
+ * Latency histogram with log2 buckets, kept by both Communicators.
+ * Bucket i counts latencies of 2^i to 2^(i+1)-1 us, the last bucket also everything longer.
+ * Counts saturate instead of wrapping.
+ */
+struct Latency_Histogram
+{
+	static const uint8_t BUCKETS = 20;					// Up to about 0.5 s, longer latencies share the last bucket.
+
+	uint16_t counts[BUCKETS];
+
+	void add(uint32_t us);
+	void print(Print& out) const;						// one "<lower bound in us>\t<count>" line per non-empty bucket
+};
+
+#endif
@@ -7,19 +7,37 @@
 
 #include "Slave.h"
 
+// --------------------------------------------------------------
+
 Command_Packet::Command_Packet(byte* buffer, bool UseSerialDebug)
 {
-	CheckParsing(buffer[0], COMMAND_START_CODE, "COMMAND_START_CODE", UseSerialDebug);
 	id = buffer[1];
-	_command = buffer[2];
+	_command = (Commands::Commands_Enum)buffer[2];
 
-	for(uint8_t i = 0 ; i < 6 ; i++)
+	for(uint8_t i = 0 ; i < Protocol::PARAMETER_COUNT ; i++)
 		Parameter[i] = buffer[i+3];
 
-	CheckParsing(buffer[9], COMMAND_END_CODE, "COMMAND_END_CODE", UseSerialDebug);
+	const uint8_t end = Protocol::COMMAND_LENGTH - 1;
+	if(buffer[0] == Protocol::COMMAND_START_CODE_V2)
+		valid = CheckParsing(buffer[end], Protocol::crc8(&buffer[1], end - 1), "COMMAND_CRC8", UseSerialDebug);
+	else
+	{
+		valid = CheckParsing(buffer[0], Protocol::COMMAND_START_CODE, "COMMAND_START_CODE", UseSerialDebug);
+		valid &= CheckParsing(buffer[end], Protocol::COMMAND_END_CODE, "COMMAND_END_CODE", UseSerialDebug);
+	}
+}
+
+Command_Packet::Command_Packet(byte id, byte* entry)
+{
+	this->id = id;
+	valid = true;
+	_command = (Commands::Commands_Enum)entry[0];
+
+	for(uint8_t i = 0 ; i < Protocol::PARAMETER_COUNT ; i++)
+		Parameter[i] = entry[i+1];
 }
 
-bool Command_Packet::CheckParsing(byte b, byte propervalue, char* varname, bool UseSerialDebug)
+bool Command_Packet::CheckParsing(byte b, byte propervalue, const char* varname, bool UseSerialDebug)
 {
 	bool retval = (b == propervalue);
 	if ((UseSerialDebug) && (!retval))
@@ -36,183 +54,748 @@ bool Command_Packet::CheckParsing(byte b, byte propervalue, char* varname, bool
 
 // --------------------------------------------------------------
 
-Response_Packet::Response_Packet(byte id): _id(id){}
+Command_Queue::Command_Queue(): _head(0), _tail(0), _overflows(0) {}
 
-byte* Response_Packet::GetPacketBytes()
+bool Command_Queue::push(const Command_Packet& cp)
 {
-	byte* packetbytes= new byte[4];
-    
-    packetbytes[0] = RESPONSE_START_CODE;
-    packetbytes[1] = _id;
-    packetbytes[2] = (status) ? OK : ERROR;
-    packetbytes[3] = RESPONSE_END_CODE;
+	uint8_t next = (_head + 1) & MASK;
+	if(next == _tail)
+	{
+		_overflows++;
+		return false;
+	}
 
-    return packetbytes;
+	volatile byte* frame = _frames[_head];
+	frame[0] = cp.id;
+	frame[1] = cp._command;
+	for(uint8_t i = 0 ; i < Protocol::PARAMETER_COUNT ; i++)
+		frame[i+2] = cp.Parameter[i];
+
+	_received[_head] = micros();
+
+	// Publish the frame only after it is completely written.
+	_head = next;
+	return true;
 }
 
+bool Command_Queue::pop(Command_Packet& cp, uint32_t* received)
+{
+	if(empty()) return false;
+
+	_read(_tail, cp);
+	if(received) *received = _received[_tail];
+
+	_tail = (_tail + 1) & MASK;
+	return true;
+}
+
+bool Command_Queue::peek(Command_Packet& cp, uint8_t offset) const
+{
+	uint8_t tail = _tail;
+	if(((_head - tail) & MASK) <= offset) return false;
+
+	_read((tail + offset) & MASK, cp);
+	return true;
+}
+
+void Command_Queue::_read(uint8_t index, Command_Packet& cp) const
+{
+	const volatile byte* frame = _frames[index];
+	cp.id = frame[0];
+	cp._command = (Command_Packet::Commands::Commands_Enum)frame[1];
+	for(uint8_t i = 0 ; i < Protocol::PARAMETER_COUNT ; i++)
+		cp.Parameter[i] = frame[i+2];
+	cp.valid = true;
+}
+
+bool Command_Queue::fits(uint8_t count)
+{
+	// Only the producer calls this, pop() can only free slots meanwhile.
+	uint8_t used = (_head - _tail) & MASK;
+	if(count <= MASK - used) return true;
+
+	_overflows += count;
+	return false;
+}
+
+uint16_t Command_Queue::overflows()
+{
+	// 16 bit reads are not atomic on AVR
+	noInterrupts();
+	uint16_t count = _overflows;
+	interrupts();
+	return count;
+}
 
 // --------------------------------------------------------------
 
-Communicator::Communicator(GraphicEngine& ge, Motion& motors):_ge(ge), _motors(motors) {}
+Response_Packet::Response_Packet(byte id): status(false), inProgress(false), _id(id){}
+
+void Response_Packet::GetPacketBytes(byte* packetbytes, uint8_t version)
+{
+    packetbytes[0] = (version >= 2) ? Protocol::RESPONSE_START_CODE_V2 : Protocol::RESPONSE_START_CODE;
+    packetbytes[1] = _id;
+    packetbytes[2] = (status) ? Protocol::OK : ((inProgress) ? Protocol::IN_PROGRESS : Protocol::ERROR);
+    packetbytes[3] = (version >= 2) ? Protocol::crc8(&packetbytes[1], 2) : Protocol::RESPONSE_END_CODE;
+}
+
+
+// --------------------------------------------------------------
+
+Communicator::Communicator(GraphicEngine& ge, Motion& motors, TwoWire& wire):_ge(ge), _motors(motors), _wire(wire) {}
 
 void Communicator::begin(uint8_t i2cAddress)
 {
 	_i2cAddress = i2cAddress;
-	Wire.begin(i2cAddress);
+	_wire.begin(i2cAddress);
+#if defined(TWAR) && defined(TWGCE)
+	// Also take the master's broadcasts to the general call address.
+	if(&_wire == &Wire) TWAR |= _BV(TWGCE);
+#endif
 	_motors.begin();
 	_ge.begin();
-  _recieved = false;
   _dataRecieved = false;
+  _textDropped = false;
+  _textLength = 0;
+  _textRefused = 0;
+  _lastStatus = true;
+  _responseVersion = 1;
+  _corruptFrames = 0;
+  _framesReceived = 0;
+  _retransmissions = 0;
+  _responsesSent = 0;
+  _commandsExecuted = 0;
+  _commandErrors = 0;
+  _latency = Latency_Histogram();
+  _lastReceivedID = 0;
+  _motionID = 0;
+  _telemetryValid = false;
+  _telemetrySample = 0;
+  _telemetryPeriod = TELEMETRY_PERIOD;
+  _telemetryTime = millis();
+  _frameLength = 0;
+  _executing = false;
+  _textWaiting = false;
+
+  // Frames are parsed and answered as they arrive, independent of loop().
+  _instance = this;
+  _wire.onReceive(_onReceive);
+  _wire.onRequest(_onRequest);
+}
+
+Communicator* Communicator::_instance = NULL;
+
+void Communicator::_onReceive(int)
+{
+	_instance->recieveCommand();
+}
+
+void Communicator::_onRequest()
+{
+	_instance->sendResponse();
+}
+
+void Communicator::setTelemetryPeriod(uint16_t period)
+{
+	_telemetryPeriod = period;
+}
+
+uint16_t Communicator::corruptFrames()
+{
+	// 16 bit reads are not atomic on AVR
+	noInterrupts();
+	uint16_t count = _corruptFrames;
+	interrupts();
+	return count;
 }
 
+// feeds the received transfer into the frame parser, called from the Wire receive handler installed by begin()
 void Communicator::recieveCommand()
 {
-	if(Wire.available() >= 10)
+	if(!_wire.available()) return;
+
+	// A frame never spans two transfers, a partial one is lost.
+	if(_frameLength)
+	{
+		_corruptFrames++;
+		_frameLength = 0;
+	}
+
+	while(_wire.available())
+		_parseByte(_wire.read());
+}
+
+// collects one byte into the current frame. Bytes in front of a start byte are skipped,
+// so the parser resynchronises on the next start byte after noise or a corrupt frame.
+void Communicator::_parseByte(byte b)
+{
+	if(_frameLength == 0)
+	{
+		switch(b)
+		{
+			case Protocol::COMMAND_START_CODE:
+			case Protocol::COMMAND_START_CODE_V2:
+				_frameExpected = Protocol::COMMAND_LENGTH;
+				break;
+			case Protocol::BATCH_START_CODE:
+			case Protocol::BATCH_START_CODE_V2:
+				_frameExpected = Protocol::BATCH_HEADER_SIZE;
+				break;
+			case Protocol::TEXT_START_CODE:
+				_frameExpected = Protocol::TEXT_HEADER_SIZE;
+				break;
+			case Protocol::DATA_START_CODE:
+				_frameExpected = Protocol::DATA_LENGTH;
+				break;
+			default:
+				return;
+		}
+	}
+
+	_frame[_frameLength++] = b;
+	if(_frameLength < _frameExpected) return;
+
+	byte start = _frame[0];
+	if((start == Protocol::BATCH_START_CODE || start == Protocol::BATCH_START_CODE_V2) && _frameLength == Protocol::BATCH_HEADER_SIZE)
+	{
+		// The header announces the number of commands.
+		if(_frame[2] > Protocol::BATCH_MAX_COMMANDS)
+		{
+			_corruptFrames++;
+			_frameLength = 0;
+			return;
+		}
+		_frameExpected = Protocol::BATCH_HEADER_SIZE + _frame[2]*Protocol::BATCH_ENTRY_SIZE + 1;
+		return;
+	}
+	if(start == Protocol::TEXT_START_CODE && _frameLength == Protocol::TEXT_HEADER_SIZE)
+	{
+		// The header announces the length of the chunk.
+		if(_frame[1] > Protocol::TEXT_CHUNK_LENGTH)
+		{
+			_corruptFrames++;
+			_textDropped = true;
+			_frameLength = 0;
+			return;
+		}
+		_frameExpected = Protocol::TEXT_HEADER_SIZE + _frame[1] + 1;
+		return;
+	}
+
+	_dispatchFrame();
+	_frameLength = 0;
+}
+
+// decodes the complete frame and queues its commands
+void Communicator::_dispatchFrame()
+{
+	byte start = _frame[0];
+	uint8_t last = _frameLength - 1;
+
+	if(start == Protocol::COMMAND_START_CODE || start == Protocol::COMMAND_START_CODE_V2)
+	{
+		Command_Packet cp(_frame, false);
+		if(!cp.valid)
+		{
+			_corruptFrames++;
+			return;
+		}
+		_framesReceived++;
+		_responseVersion = (start == Protocol::COMMAND_START_CODE_V2) ? 2 : 1;
+		if(_isRetransmission(cp.id) || !_commands.fits(1)) return;
+		_commands.push(cp);
+		if(cp.id != Protocol::BROADCAST_ID)
+			_lastReceivedID = cp.id;
+	}
+	else if(start == Protocol::BATCH_START_CODE || start == Protocol::BATCH_START_CODE_V2)
+	{
+		bool valid = (start == Protocol::BATCH_START_CODE_V2) ? (_frame[last] == Protocol::crc8(&_frame[1], last - 1))
+		                                                      : (_frame[last] == Protocol::BATCH_END_CODE);
+		if(!valid)
+		{
+			_corruptFrames++;
+			return;
+		}
+		_framesReceived++;
+		_responseVersion = (start == Protocol::BATCH_START_CODE_V2) ? 2 : 1;
+		// A batch is queued completely or not at all.
+		if(_isRetransmission(_frame[1]) || !_commands.fits(_frame[2])) return;
+		for(uint8_t i = 0 ; i < _frame[2] ; i++)
+			_commands.push(Command_Packet(_frame[1], &_frame[Protocol::BATCH_HEADER_SIZE + i*Protocol::BATCH_ENTRY_SIZE]));
+		_lastReceivedID = _frame[1];
+	}
+	else if(start == Protocol::TEXT_START_CODE)
+	{
+		if(_frame[last] != Protocol::crc8(&_frame[1], last - 1))
+		{
+			// The text is incomplete now, drop it up to its last chunk.
+			_corruptFrames++;
+			_textDropped = true;
+		}
+		else
+		{
+			_framesReceived++;
+
+			// The previous text stays untouched until its DRAW_TEXT has drawn it,
+			// this one is dropped up to its last chunk.
+			if(_dataRecieved && !_textDropped)
+			{
+				_textRefused++;
+				_textDropped = true;
+			}
+
+			// Reassemble into the bounded text buffer, excess text is cut off.
+			if(!_textDropped)
+				for(uint8_t i = Protocol::TEXT_HEADER_SIZE ; i < last && _textLength < TEXT_BUFFER_LENGTH - 1 ; i++)
+					textBuffer[_textLength++] = (char)_frame[i];
+		}
+
+		if(!_frame[2])
+		{
+			if(!_dataRecieved)
+			{
+				textBuffer[_textLength] = '\0';
+				_dataRecieved = !_textDropped;
+			}
+			_textDropped = false;
+			_textLength = 0;
+		}
+	}
+	else if(start == Protocol::DATA_START_CODE)
 	{
-    byte temp = Wire.read();
-    if(temp == 0x55)
-    {
-      commandBuffer[0] = temp;
-      for(uint8_t i = 1 ; i < 10 ; i++)
-        commandBuffer[i] = Wire.read();
-      _recieved = true;
-    }
-    else if(temp == 0xDD)
-    {
-      dataBuffer[0] = (char)temp;
-      for(uint8_t i = 1 ; i < 20 ; i++){
-        dataBuffer[i] = (char)Wire.read();
-      }
-      _dataRecieved = true;
-    }
+		if(_frame[last] != Protocol::DATA_END_CODE)
+		{
+			_corruptFrames++;
+			return;
+		}
+		_framesReceived++;
+		if(_dataRecieved)
+		{
+			_textRefused++;
+			return;
+		}
+		for(uint8_t i = 1 ; i < last ; i++)
+			textBuffer[i-1] = (char)_frame[i];
+		textBuffer[last - 2] = '\0';
+		_dataRecieved = true;
 	}
 }
 
+// true if a version 2 packet repeats the sequence number of the previous one,
+// i.e. the master retransmitted a packet whose acknowledge it missed.
+// Version 1 ids are random and may legitimately repeat. Broadcasts are never
+// retransmitted and must never be dropped, they neither match nor set the last id.
+// The id is recorded by the caller once the packet is queued, a packet
+// rejected because the queue is full is accepted when it is retransmitted.
+bool Communicator::_isRetransmission(byte id)
+{
+	if(_responseVersion < 2 || id == Protocol::BROADCAST_ID) return false;
+
+	bool retval = (id == _lastReceivedID);
+	if(retval) _retransmissions++;
+	return retval;
+}
+
+// executes the queued commands in order, advances a running MOVE_TO / TURN_ANGLE
+// and refreshes the telemetry snapshot. Commands sharing an id (a batch) are answered with one aggregated status.
+// A motion command waits at the head of the queue until the running motion is done,
+// DRAW_TEXT until its text arrived. Has to be called from loop() on every pass.
 void Communicator::executeCommand()
 {
-	if(!_recieved) return;
-
-	Command_Packet *cp = new Command_Packet(commandBuffer, true);
-	_lastCommandID = cp->id;
-	float tmp_1;
-	
-	switch(cp->_command)
-	{
-    case Command_Packet::Commands::LEFT_MOTOR:
-      if(cp->Parameter[0] == 0)
-        _motors.motor_l->go((-1)*cp->Parameter[1]);
-      else
-        _motors.motor_l->go(cp->Parameter[1]);
-    break;
-
-    case Command_Packet::Commands::RIGHT_MOTOR:
-      if(cp->Parameter[0] == 0)
-        _motors.motor_r->go((-1)*cp->Parameter[1]);
-      else
-        _motors.motor_r->go(cp->Parameter[1]);
-    break;
-
-    case Command_Packet::Commands::MOVE:
-		tmp_1 = map(cp->Parameter[1], 0, 100 , 0, 255);
-	if(cp->Parameter[0] == 0)
-      {
-        _motors.motor_l->go((-1)*tmp_1);
-        _motors.motor_r->go((-1)*tmp_1);
-      }
-      else
-      {
-        _motors.motor_l->go(tmp_1);
-        _motors.motor_r->go(tmp_1);
-      }
-    break;
-
-    case Command_Packet::Commands::TURN:
-      if(cp->Parameter[0] == 0)
-      {
-        _motors.motor_l->go(cp->Parameter[1]);
-        _motors.motor_r->go((-1)*cp->Parameter[1]);
-      }
-      else
-      {
-        _motors.motor_l->go((-1)*cp->Parameter[1]);
-        _motors.motor_r->go(cp->Parameter[1]);
-      }
-    break;
-
-		case Command_Packet::Commands::MOVE_TO:
-			tmp_1 = (float)cp->Parameter[0];
-      tmp_1 /= 100;
-			if(cp->Parameter[1] == 0)
-				tmp_1 *= -1;
-			_motors.move_to(tmp_1);
-      while(!_motors.updt()){}
-		break;
-      
-    case Command_Packet::Commands::TURN_ANGLE:
-      tmp_1 = (float)cp->Parameter[0];
-      tmp_1 /= 255;
-      tmp_1 *= (2*3.1415);
-      if(cp->Parameter[1] == 1)
-        tmp_1 *= -1;
-      _motors.rotate_to(tmp_1);
-      while(!_motors.updt()){}
-    break;
-
-		case Command_Packet::Commands::STOP:
-			_motors.stop();
-			break;
-		
-		// case Command_Packet::Commands::DRAW_POINT:
-		// 	_ge.drawPixel(cp->Parameter[0], cp->Parameter[1]);
-		// 	break;
-
-		case Command_Packet::Commands::DRAW_LINE:
-			_ge.drawLine(cp->Parameter[0], cp->Parameter[1], cp->Parameter[2], cp->Parameter[3]);
-			break;
-		
-		case Command_Packet::Commands::DRAW_CIRCLE:
-			_ge.drawCircle(cp->Parameter[0], cp->Parameter[1], cp->Parameter[2]);
-			break;
-		
-		case Command_Packet::Commands::DRAW_DISC:
-			_ge.drawDisc(cp->Parameter[0], cp->Parameter[1], cp->Parameter[2]);
-			break;
-		
-		case Command_Packet::Commands::DRAW_TRIANGLE:
-			_ge.drawTriangle(cp->Parameter[0], cp->Parameter[1], cp->Parameter[2], cp->Parameter[3], cp->Parameter[4], cp->Parameter[5]);
-			break;
-
-		case Command_Packet::Commands::DRAW_RECTANGLE:
-			_ge.drawRectangle(cp->Parameter[0], cp->Parameter[1], cp->Parameter[2], cp->Parameter[3]);
-			break;
-
-		case Command_Packet::Commands::DRAW_BOX:
-			_ge.drawBox(cp->Parameter[0], cp->Parameter[1], cp->Parameter[2], cp->Parameter[3]);
-			break;
-
-		case Command_Packet::Commands::DRAW_TEXT:
-        while(!_dataRecieved){
-          delay(5);
-        }
-        _ge.drawStr(&dataBuffer[1]);
-        _dataRecieved = false;
-			break;
-		
-		case Command_Packet::Commands::CLEAR_SCREEN:
-			_ge.clear();
-			break;
-	}
-	delete cp;
-	_recieved = false;
+	Command_Packet cp;
+	Command_Handler handler;
+	uint32_t received = 0;
+	while(_commands.peek(cp) && !_waits(cp))
+	{
+		_commands.pop(cp, &received);
+
+		// sendResponse() runs from the request handler and must see id and status together.
+		noInterrupts();
+		if(cp.id != _lastCommandID)
+			_lastStatus = true;
+		_lastCommandID = cp.id;
+		_executing = true;
+		interrupts();
+
+		bool status = _execute(cp);
+		_lastStatus = _lastStatus && status;
+		if(_motors.getMode() != 0 && _lookup(cp._command, handler) && (handler.flags & Command_Handler::MOTION))
+			_motionID = cp.id;
+		_executing = false;
+
+		_commandsExecuted++;
+		if(!status) _commandErrors++;
+		_latency.add(micros() - received);
+	}
+
+	if(_motors.getMode() != 0)
+		_motors.updt();
+
+	_updateTelemetry();
+}
+
+// true if cp is a motion command that has to wait for the running motion.
+// A Stop or direct motor command queued behind it cancels the wait, the waiting
+// motions then start and are stopped right away in queue order.
+bool Communicator::_waits(const Command_Packet& cp)
+{
+	if(cp._command == Command_Packet::Commands::DrawText)
+		return _awaitsText();
+
+	Command_Handler handler;
+	if(_motors.getMode() == 0 || !_lookup(cp._command, handler) || !(handler.flags & Command_Handler::MOTION))
+		return false;
+
+	Command_Packet next;
+	for(uint8_t i = 1 ; _commands.peek(next, i) ; i++)
+		if(_lookup(next._command, handler) && (handler.flags & Command_Handler::PREEMPTS))
+			return false;
+	return true;
+}
+
+// true while DRAW_TEXT waits for its text, for at most TEXT_TIMEOUT from the first call
+bool Communicator::_awaitsText()
+{
+	if(_dataRecieved || _textRefused)
+	{
+		_textWaiting = false;
+		return false;
+	}
+	if(!_textWaiting)
+	{
+		_textWaiting = true;
+		_textWaitStart = millis();
+	}
+	if(millis() - _textWaitStart < TEXT_TIMEOUT) return true;
+
+	_textWaiting = false;
+	return false;
+}
+
+// refreshes the telemetry snapshot once per telemetry period
+void Communicator::_updateTelemetry()
+{
+	if(_telemetryValid && millis() - _telemetryTime < _telemetryPeriod) return;
+	_telemetryTime = millis();
+
+	Telemetry_Packet tp;
+	tp.sample = ++_telemetrySample;
+	tp.mode = _motors.getMode();
+	tp.posL = _motors.wheel_l->getPos();
+	tp.posR = _motors.wheel_r->getPos();
+	tp.omegaL = (float)_motors.wheel_l->getOmega();
+	tp.omegaR = (float)_motors.wheel_r->getOmega();
+	tp.pwmL = _motors.getPwmL();
+	tp.pwmR = _motors.getPwmR();
+
+	byte packetBytes[Protocol::TELEMETRY_LENGTH];
+	tp.GetPacketBytes(packetBytes);
+
+	// sendResponse() must never see a half written snapshot
+	noInterrupts();
+	for(uint8_t i = 0 ; i < Protocol::TELEMETRY_LENGTH ; i++)
+		_telemetry[i] = packetBytes[i];
+	_telemetryValid = true;
+	interrupts();
+}
+
+// direct motor commands take over from a running MOVE_TO / TURN_ANGLE
+void Communicator::_abortMotion()
+{
+	if(_motors.getMode() != 0)
+		_motors.stop();
+}
+
+// --------------------------------------------------------------
+// Command dispatch
+//
+// One handler table per high nibble of the command byte, indexed by the low nibble.
+// A new command only needs its handler and a row in the matching table.
+
+const Command_Handler Communicator::SYSTEM_COMMANDS[] PROGMEM = {
+	{ 0, 0, NULL },									// 0x00 NotSet
+	{ 1, 0, &Communicator::_version },				// 0x01 Version
+};
+
+const Command_Handler Communicator::DISPLAY_COMMANDS[] PROGMEM = {
+	{ 2, 0, &Communicator::_drawPoint },			// 0x10 DrawPoint
+	{ 0, 0, NULL },									// 0x11
+	{ 4, 0, &Communicator::_drawLine },				// 0x12 DrawLine
+	{ 3, 0, &Communicator::_drawCircle },			// 0x13 DrawCircle
+	{ 3, 0, &Communicator::_drawDisc },				// 0x14 DrawDisc
+	{ 6, 0, &Communicator::_drawTriangle },			// 0x15 DrawTriangle
+	{ 4, 0, &Communicator::_drawRectangle },		// 0x16 DrawRectangle
+	{ 4, 0, &Communicator::_drawBox },				// 0x17 DrawBox
+	{ 0, 0, &Communicator::_drawText },				// 0x18 DrawText
+	{ 0, 0, &Communicator::_clearScreen },			// 0x19 ClearScreen
+};
+
+const Command_Handler Communicator::MOTION_COMMANDS[] PROGMEM = {
+	{ 0, 0, NULL },																// 0x30
+	{ 2, Command_Handler::PREEMPTS, &Communicator::_leftMotor },				// 0x31 LeftMotor
+	{ 2, Command_Handler::PREEMPTS, &Communicator::_rightMotor },				// 0x32 RightMotor
+	{ 2, Command_Handler::PREEMPTS, &Communicator::_move },						// 0x33 Move
+	{ 3, Command_Handler::MOTION, &Communicator::_moveTo },						// 0x34 MoveDistance
+	{ 0, Command_Handler::PREEMPTS, &Communicator::_stop },						// 0x35 Stop
+	{ 3, Command_Handler::MOTION, &Communicator::_turnAngle },					// 0x36 TurnAngle
+	{ 2, Command_Handler::PREEMPTS, &Communicator::_turn },						// 0x37 Turn
+	{ 4, Command_Handler::PREEMPTS, &Communicator::_drive },					// 0x38 Drive
+	{ 6, Command_Handler::MOTION, &Communicator::_moveMillimeters },			// 0x39 MoveMillimeters
+	{ 6, Command_Handler::MOTION, &Communicator::_turnCentidegrees },			// 0x3A TurnCentidegrees
+};
+
+const Command_Group Communicator::COMMAND_GROUPS[] PROGMEM = {
+	{ SYSTEM_COMMANDS, sizeof(SYSTEM_COMMANDS) / sizeof(Command_Handler) },		// 0x0_
+	{ DISPLAY_COMMANDS, sizeof(DISPLAY_COMMANDS) / sizeof(Command_Handler) },	// 0x1_
+	{ NULL, 0 },																// 0x2_
+	{ MOTION_COMMANDS, sizeof(MOTION_COMMANDS) / sizeof(Command_Handler) },		// 0x3_
+};
+
+// copies the table entry of the command byte out of PROGMEM, false for unassigned command bytes
+bool Communicator::_lookup(byte command, Command_Handler& handler)
+{
+	uint8_t group = command >> 4;
+	uint8_t index = command & 0x0F;
+	if(group >= sizeof(COMMAND_GROUPS) / sizeof(Command_Group)) return false;
+
+	Command_Group g;
+	memcpy_P(&g, &COMMAND_GROUPS[group], sizeof(g));
+	if(index >= g.count) return false;
+
+	memcpy_P(&handler, &g.handlers[index], sizeof(handler));
+	return handler.execute != NULL;
+}
+
+// executes a single command straight from its decoded packet.
+// Returns false if the command is unknown, uses more parameters than it takes, or fails.
+bool Communicator::_execute(const Command_Packet& cp)
+{
+	Command_Handler handler;
+	if(!_lookup(cp._command, handler)) return false;
+
+	// Parameters a command does not take must be 0.
+	for(uint8_t i = handler.arity ; i < Protocol::PARAMETER_COUNT ; i++)
+		if(cp.Parameter[i]) return false;
+
+	return handler.execute(*this, cp);
 }
 
+bool Communicator::_version(Communicator&, const Command_Packet&)
+{
+	// Nothing to do, the response is sent in the version of the probe.
+	return true;
+}
+
+bool Communicator::_drawPoint(Communicator& c, const Command_Packet& cp)
+{
+	return c._ge.drawPixel(cp.Parameter[0], cp.Parameter[1]) >= 0;
+}
+
+bool Communicator::_drawLine(Communicator& c, const Command_Packet& cp)
+{
+	return c._ge.drawLine(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2], cp.Parameter[3]) >= 0;
+}
+
+bool Communicator::_drawCircle(Communicator& c, const Command_Packet& cp)
+{
+	return c._ge.drawCircle(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2]) >= 0;
+}
+
+bool Communicator::_drawDisc(Communicator& c, const Command_Packet& cp)
+{
+	return c._ge.drawDisc(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2]) >= 0;
+}
+
+bool Communicator::_drawTriangle(Communicator& c, const Command_Packet& cp)
+{
+	return c._ge.drawTriangle(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2], cp.Parameter[3], cp.Parameter[4], cp.Parameter[5]) >= 0;
+}
+
+bool Communicator::_drawRectangle(Communicator& c, const Command_Packet& cp)
+{
+	return c._ge.drawRectangle(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2], cp.Parameter[3]) >= 0;
+}
+
+bool Communicator::_drawBox(Communicator& c, const Command_Packet& cp)
+{
+	return c._ge.drawBox(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2], cp.Parameter[3]) >= 0;
+}
+
+// runs once _awaitsText() let the command through, without text it timed out or was refused
+bool Communicator::_drawText(Communicator& c, const Command_Packet&)
+{
+	if(!c._dataRecieved)
+	{
+		// The text of this command was refused while the previous one was pending.
+		if(c._textRefused) c._textRefused--;
+		return false;
+	}
+	c._ge.drawStr((char*)c.textBuffer);
+	c._dataRecieved = false;
+	return true;
+}
+
+bool Communicator::_clearScreen(Communicator& c, const Command_Packet&)
+{
+	c._ge.clear();
+	return true;
+}
+
+bool Communicator::_leftMotor(Communicator& c, const Command_Packet& cp)
+{
+	c._abortMotion();
+	if(cp.Parameter[0] == 0)
+		c._motors.motor_l->go((-1)*cp.Parameter[1]);
+	else
+		c._motors.motor_l->go(cp.Parameter[1]);
+	return true;
+}
+
+bool Communicator::_rightMotor(Communicator& c, const Command_Packet& cp)
+{
+	c._abortMotion();
+	if(cp.Parameter[0] == 0)
+		c._motors.motor_r->go((-1)*cp.Parameter[1]);
+	else
+		c._motors.motor_r->go(cp.Parameter[1]);
+	return true;
+}
+
+bool Communicator::_move(Communicator& c, const Command_Packet& cp)
+{
+	c._abortMotion();
+	// The master maps the speed to PWM already, as for Drive.
+	int speed = cp.Parameter[1];
+	if(cp.Parameter[0] == 0)
+		speed *= -1;
+	c._motors.motor_l->go(speed);
+	c._motors.motor_r->go(speed);
+	return true;
+}
+
+bool Communicator::_turn(Communicator& c, const Command_Packet& cp)
+{
+	c._abortMotion();
+	if(cp.Parameter[0] == 0)
+	{
+		c._motors.motor_l->go(cp.Parameter[1]);
+		c._motors.motor_r->go((-1)*cp.Parameter[1]);
+	}
+	else
+	{
+		c._motors.motor_l->go((-1)*cp.Parameter[1]);
+		c._motors.motor_r->go(cp.Parameter[1]);
+	}
+	return true;
+}
+
+bool Communicator::_drive(Communicator& c, const Command_Packet& cp)
+{
+	c._abortMotion();
+	c._motors.motor_l->go((cp.Parameter[0] == 0) ? (-1)*cp.Parameter[1] : cp.Parameter[1]);
+	c._motors.motor_r->go((cp.Parameter[2] == 0) ? (-1)*cp.Parameter[3] : cp.Parameter[3]);
+	return true;
+}
+
+bool Communicator::_moveTo(Communicator& c, const Command_Packet& cp)
+{
+	float distance = (float)cp.Parameter[0];
+	distance /= 100;
+	if(cp.Parameter[1] == 0)
+		distance *= -1;
+	return c._motors.move_to(distance);
+}
+
+bool Communicator::_turnAngle(Communicator& c, const Command_Packet& cp)
+{
+	float angle = (float)cp.Parameter[0];
+	angle /= 255;
+	angle *= (2*3.1415);
+	if(cp.Parameter[1] == 1)
+		angle *= -1;
+	return c._motors.rotate_to(angle);
+}
+
+// The speed caps the motion profile, 0 leaves it to Motion.
+bool Communicator::_moveMillimeters(Communicator& c, const Command_Packet& cp)
+{
+	return c._motors.move_to_mm(Protocol::readInt32(cp.Parameter), (uint16_t)Protocol::readInt16(&cp.Parameter[4]));
+}
+
+bool Communicator::_turnCentidegrees(Communicator& c, const Command_Packet& cp)
+{
+	return c._motors.rotate_to_cdeg(Protocol::readInt32(cp.Parameter), (uint16_t)Protocol::readInt16(&cp.Parameter[4]));
+}
+
+bool Communicator::_stop(Communicator& c, const Command_Packet&)
+{
+	c._motors.stop();
+	return true;
+}
+
+// answers the master's read, called from the Wire request handler installed by begin().
+// Builds the reply on the stack, no heap allocation.
 void Communicator::sendResponse()
 {
-	Response_Packet *rp = new Response_Packet(_lastCommandID); 
-	rp->status = (_motors.getMode() == 0) && !_recieved;
-	byte *packetBytes = rp->GetPacketBytes();
-	Wire.write(packetBytes, 4);
+	byte packetBytes[Protocol::RESPONSE_LENGTH + Protocol::TELEMETRY_LENGTH];
+	uint8_t length = Protocol::RESPONSE_LENGTH;
+
+	// Only the packet that started the motion waits for it, later commands report their own status.
+	Command_Packet next;
+	Response_Packet rp(_lastCommandID);
+	bool busy = _executing
+	         || (_commands.peek(next) && next.id == _lastCommandID)
+	         || (_motors.getMode() != 0 && _motionID == _lastCommandID);
+	rp.status = _lastStatus && !busy;
+	rp.inProgress = _lastStatus && busy;
+	rp.GetPacketBytes(packetBytes, _responseVersion);
+
+	// Version 2 masters read the telemetry right behind the response, others stop after 4 bytes.
+	if(_responseVersion >= 2 && _telemetryValid)
+	{
+		for(uint8_t i = 0 ; i < Protocol::TELEMETRY_LENGTH ; i++)
+			packetBytes[length++] = _telemetry[i];
+	}
+
+	_wire.write(packetBytes, length);
+	_responsesSent++;
+}
 
-	delete packetBytes;
-	delete rp;
+Link_Stats Communicator::stats()
+{
+	Link_Stats stats;
+	stats.overflows = _commands.overflows();
+
+	// 16 bit counters are updated from the Wire handlers
+	noInterrupts();
+	stats.framesReceived = _framesReceived;
+	stats.corruptFrames = _corruptFrames;
+	stats.retransmissions = _retransmissions;
+	stats.responsesSent = _responsesSent;
+	interrupts();
+
+	stats.commandsExecuted = _commandsExecuted;
+	stats.commandErrors = _commandErrors;
+	stats.latency = _latency;
+	return stats;
+}
+
+void Communicator::printStats(Print& out)
+{
+	Link_Stats s = stats();
+	out.print("received: ");
+	out.print(s.framesReceived);
+	out.print("\tcorrupt: ");
+	out.print(s.corruptFrames);
+	out.print("\tretransmissions: ");
+	out.print(s.retransmissions);
+	out.print("\toverflows: ");
+	out.print(s.overflows);
+	out.print("\texecuted: ");
+	out.print(s.commandsExecuted);
+	out.print("\terrors: ");
+	out.print(s.commandErrors);
+	out.print("\tresponses: ");
+	out.println(s.responsesSent);
+	s.latency.print(out);
 }
@@ -11,108 +11,248 @@
 #include "Arduino.h"
 #include "Wire.h"
 
+#include "Protocol.h"
+
 #include "U8g2_GraphicsEngine.h"
 #include "Motion.h"
 
-/**
- * Command Packet Structure:
- * Byte 1: Start Byte - Always 0x55
- * Byte 2: An random generated ID for the Command, same ID is sent in response.
- * Byte 3: Command Byte - Identifies Command
- * Byte 4-9: Parameters - Varies from Command to Command
- * Byte 10: End Byte - Always 0x99
- */
+// Longest text, including the terminating NUL, that DRAW_TEXT can display. Longer text is cut off.
+#ifndef TEXT_BUFFER_LENGTH
+	#define TEXT_BUFFER_LENGTH 64
+#endif
+
+// Number of decoded commands the slave can hold before executing them, must be a power of two.
+#ifndef COMMAND_QUEUE_DEPTH
+	#define COMMAND_QUEUE_DEPTH 8
+#endif
+
+/** Command received from the master, see Command Packet and Batch Packet Structure in Protocol.h. */
 class Command_Packet
 {
 	public:
-		// Declaring Enums inside an embedded class or struct does not pollute Global/Class Scope
-		class Commands
-		{
-			public:
-				enum Commands_Enum
-				{
-					NOT_SET				= 0x00,		// Default value for enum. Slave will return error if sent this.
-					DRAW_POINT			= 0x10,		// Draw Point on OLED.
-					DRAW_LINE			= 0x12,		// Draw Line on OLED.
-					DRAW_CIRCLE			= 0x13,		// Draw Circle on OLED.
-					DRAW_DISC 			= 0x14,		// Draw Filled Disc on OLED.
-					DRAW_TRIANGLE		= 0x15,		// Draw Circle on OLED.
-					DRAW_RECTANGLE		= 0x16,		// Draw Rectangle on OLED.
-					DRAW_BOX  			= 0x17,		// Draw Filed Box on OLED.
-					DRAW_TEXT        	= 0x18,     // Displays text on the OLED.
-          			CLEAR_SCREEN    	= 0x19,     // Clears the Screen
-		      		LEFT_MOTOR     		= 0x31,     // Move Left Motor.
-					RIGHT_MOTOR    		= 0x32,
-					MOVE           		= 0X33,
-					MOVE_TO        		= 0x34, 
-					STOP           		= 0X35,
-					TURN_ANGLE     		= 0X36,
-					TURN           		= 0X37
-		};
-	};
+		typedef Protocol::Commands Commands;			// Command bytes shared with the master, see Protocol.h
 	
 		byte id;										// An unique id for each new command.	
-		byte Parameter[6];								// Parameter 6 bytes, changes meaning depending on command							
+		bool valid;										// false if framing or CRC-8 is corrupt.
+		byte Parameter[Protocol::PARAMETER_COUNT];								// Parameter 6 bytes, changes meaning depending on command							
 		Commands::Commands_Enum _command;	
 
+		Command_Packet() {}
 		Command_Packet(byte* buffer, bool UseSerialDebug);
-		bool CheckParsing(byte b, byte propervalue, char* varname, bool UseSerialDebug);
-
-	private: 
-		static const byte COMMAND_START_CODE = 0x55;	// Static byte to mark the beginning of a command packet	-	never changes
-		static const byte COMMAND_END_CODE = 0x99;		// Static byte to mark the end of a command packet	-	never changes
-
-		// word _CalculateChecksum();						// Checksum is calculated using byte addition
-		// byte GetHighByte(word w);						
-		// byte GetLowByte(word w);
+		Command_Packet(byte id, byte* entry);			// decodes a 7 byte batch entry (command + parameters)
+		bool CheckParsing(byte b, byte propervalue, const char* varname, bool UseSerialDebug);
 };
 
 
 /**
- * Response Packet Structure:
- * Byte 1: Start Byte - Always 0xAA
- * Byte 2: The Command ID sent by Master.
- * Byte 3: Status - OK or ERROR
- * Byte 4: End Byte - Always 0x11
+ * Single-producer/single-consumer ring of decoded commands.
+ *
+ * push() is called from the Wire receive handler and pop() from executeCommand().
+ * Each side only writes its own index, and single byte index writes are atomic,
+ * so no interrupt locking is needed. Commands pushed while the ring is full are dropped and counted.
  */
+class Command_Queue
+{
+	public:
+		Command_Queue();
+		bool push(const Command_Packet&);				// returns false and counts an overflow if full
+		bool pop(Command_Packet&, uint32_t* received = NULL);	// returns false if empty, received is set to the micros() of push()
+		bool peek(Command_Packet&, uint8_t offset = 0) const;	// reads the command offset places behind the oldest without removing it
+		bool empty() const { return _head == _tail; }
+		bool fits(uint8_t count);						// returns false and counts count overflows if fewer slots are free
+		uint16_t overflows();							// commands dropped because the ring was full
+
+	private:
+		static const uint8_t FRAME_SIZE = 2 + Protocol::PARAMETER_COUNT;	// ID, Command byte and Parameters.
+		static const uint8_t MASK = COMMAND_QUEUE_DEPTH - 1;
+		static_assert((COMMAND_QUEUE_DEPTH & MASK) == 0, "COMMAND_QUEUE_DEPTH must be a power of two");
+
+		volatile byte _frames[COMMAND_QUEUE_DEPTH][FRAME_SIZE];
+		volatile uint32_t _received[COMMAND_QUEUE_DEPTH];
+		volatile uint8_t _head, _tail;					// _head is written by push() only, _tail by pop() only.
+		volatile uint16_t _overflows;
+
+		void _read(uint8_t index, Command_Packet&) const;
+};
+
+
+class Communicator;
+
+/** Entry of the slave's command dispatch table. */
+struct Command_Handler
+{
+	static const uint8_t MOTION = 0x01;				// Starts a MOVE_TO / ROTATE_TO, waits in the queue while another motion runs.
+	static const uint8_t PREEMPTS = 0x02;				// Takes over the motors, cancels running and waiting motions.
+
+	uint8_t arity;										// Parameters taken by the command, the remaining ones must be 0.
+	uint8_t flags;										// MOTION, PREEMPTS or 0.
+	bool (*execute)(Communicator&, const Command_Packet&);	// Executes the command, NULL for unassigned command bytes.
+};
+
+/** Handlers of the commands sharing the high nibble of their command byte. */
+struct Command_Group
+{
+	const Command_Handler* handlers;					// Indexed by the low nibble of the command byte.
+	uint8_t count;
+};
+
+
+/** Response to the master, see Response Packet Structure in Protocol.h. */
 class Response_Packet
 {
 	public:
 		bool status;
+		bool inProgress;
 
 		Response_Packet(byte id);						
-		byte* GetPacketBytes();							// returns the bytes to be transmitted
+		void GetPacketBytes(byte* out, uint8_t version);	// writes the RESPONSE_LENGTH bytes to be transmitted into out
 
 	private: 
-		static const byte RESPONSE_START_CODE = 0xAA;	// Static byte to mark the beginning of a command packet	-	never changes
-		static const byte RESPONSE_END_CODE = 0x11;		// Static byte to mark the end of a command packet	-	never changes
-		static const byte OK = 0x50;
-		static const byte ERROR = 0x51;
-
 		byte _id;
 };
 
 
 
+/** Bus health statistics of the slave. */
+struct Link_Stats
+{
+	uint16_t framesReceived;							// Valid packets received.
+	uint16_t corruptFrames;								// Packets rejected because of bad framing or CRC-8, and skipped partial frames.
+	uint16_t retransmissions;							// Repeated packets dropped because they were received already.
+	uint16_t overflows;									// Commands dropped because the command queue was full.
+	uint16_t commandsExecuted;							// Commands executed, whatever their status.
+	uint16_t commandErrors;								// Commands that were unknown, malformed or failed.
+	uint16_t responsesSent;								// Responses written to the master.
+	Latency_Histogram latency;							// Receipt to completion of every command, in us.
+};
+
+
 class Communicator
 {
 	public:
-		Communicator(GraphicEngine&, Motion&);
+		/** Constructor for the slave Communicator.
+         *
+         *  @param ge     Graphic engine executing the draw commands.
+         *  @param motors Motion controller executing the motor commands.
+         *  @param wire   The I2C bus to listen on. The host build in test/ links a simulated Wire library instead.
+         */
+		Communicator(GraphicEngine&, Motion&, TwoWire& wire = Wire);
+
+		/** Joins the bus as slave and installs the Wire receive and request handlers.
+         *
+         *  Frames are then parsed and answered from the handlers, only one slave Communicator can be active.
+         *
+         *  @param i2cAddress I2C address of the slave.
+         */
 		void begin(uint8_t);
+
+		/** Parses the bytes of the last transfer and queues the decoded commands. Called by the receive handler. */
 		void recieveCommand();
+
+		/** Executes the queued commands, has to be called from loop() on every pass. */
 		void executeCommand();
+
+		/** Writes the Response Packet for the last command. Called by the request handler. */
 		void sendResponse();
 
+		/** Number of received commands dropped because the command queue was full. */
+		uint16_t overflows() { return _commands.overflows(); }
+
+		/** Number of received packets rejected because of bad framing or CRC-8. */
+		uint16_t corruptFrames();
+
+		/** Snapshot of the statistics since begin(). */
+		Link_Stats stats();
+
+		/** Prints the statistics and the latency histogram, e.g. to Serial. */
+		void printStats(Print& out = Serial);
+
+		/** Sets how often executeCommand() refreshes the telemetry snapshot sent along with responses.
+         *
+         *  @param period Refresh period in ms, 20 ms by default. 0 refreshes on every call.
+         */
+		void setTelemetryPeriod(uint16_t);
+
 	private:
+		static const uint16_t TEXT_TIMEOUT = 500;		// Time DrawText waits for its text, in ms.
+		static const uint16_t TELEMETRY_PERIOD = 20;	// Default refresh period of the telemetry snapshot, in ms.
+		static_assert(TEXT_BUFFER_LENGTH >= Protocol::DATA_LENGTH - 1, "TEXT_BUFFER_LENGTH must hold a version 1 Data Packet");
+
 		GraphicEngine& _ge;
 		Motion& _motors;
+		TwoWire& _wire;
 
 		uint8_t _i2cAddress;
 		volatile uint8_t _lastCommandID;
+		volatile bool _lastStatus;						// false if any command of the last packet or batch failed.
+		volatile uint8_t _responseVersion;				// Protocol version of the last valid packet received.
+		volatile uint8_t _lastReceivedID;				// Sequence number of the last packet received, to drop retransmissions.
+		volatile uint8_t _motionID;						// Sequence number of the packet that started the running motion.
+		volatile uint16_t _corruptFrames, _framesReceived, _retransmissions, _responsesSent;
+		uint16_t _commandsExecuted, _commandErrors;
+		Latency_Histogram _latency;
 		
-		volatile byte commandBuffer[10];
-		volatile char dataBuffer[20];
-		volatile bool _recieved, _dataRecieved;
+		Command_Queue _commands;						// Commands received but not executed yet.
+		volatile char textBuffer[TEXT_BUFFER_LENGTH];	// Text for DRAW_TEXT, reassembled from Text Packets.
+		volatile uint8_t _textLength;
+		volatile bool _dataRecieved, _textDropped;
+		volatile uint8_t _textRefused;					// Texts refused because textBuffer was still in use.
+		bool _textWaiting;								// DRAW_TEXT waits at the head of the queue since _textWaitStart.
+		uint32_t _textWaitStart;
+
+		volatile byte _telemetry[Protocol::TELEMETRY_LENGTH];	// Latest snapshot, see Telemetry Packet Structure.
+		volatile bool _telemetryValid;
+		byte _telemetrySample;
+		uint16_t _telemetryPeriod;
+		uint32_t _telemetryTime;
+
+		bool _execute(const Command_Packet&);
+		bool _lookup(byte command, Command_Handler&);
+		bool _waits(const Command_Packet&);
+		bool _awaitsText();
+		void _abortMotion();
+		void _updateTelemetry();
+
+		// Command dispatch tables in PROGMEM, see _execute().
+		static const Command_Handler SYSTEM_COMMANDS[];
+		static const Command_Handler DISPLAY_COMMANDS[];
+		static const Command_Handler MOTION_COMMANDS[];
+		static const Command_Group COMMAND_GROUPS[];
+		friend class Dispatch_Probe;					// Times _execute() on the host, see test/bench_dispatch.cpp.
+
+		static bool _version(Communicator&, const Command_Packet&);
+		static bool _drawPoint(Communicator&, const Command_Packet&);
+		static bool _drawLine(Communicator&, const Command_Packet&);
+		static bool _drawCircle(Communicator&, const Command_Packet&);
+		static bool _drawDisc(Communicator&, const Command_Packet&);
+		static bool _drawTriangle(Communicator&, const Command_Packet&);
+		static bool _drawRectangle(Communicator&, const Command_Packet&);
+		static bool _drawBox(Communicator&, const Command_Packet&);
+		static bool _drawText(Communicator&, const Command_Packet&);
+		static bool _clearScreen(Communicator&, const Command_Packet&);
+		static bool _leftMotor(Communicator&, const Command_Packet&);
+		static bool _rightMotor(Communicator&, const Command_Packet&);
+		static bool _move(Communicator&, const Command_Packet&);
+		static bool _turn(Communicator&, const Command_Packet&);
+		static bool _drive(Communicator&, const Command_Packet&);
+		static bool _moveMillimeters(Communicator&, const Command_Packet&);
+		static bool _turnCentidegrees(Communicator&, const Command_Packet&);
+		static bool _moveTo(Communicator&, const Command_Packet&);
+		static bool _turnAngle(Communicator&, const Command_Packet&);
+		static bool _stop(Communicator&, const Command_Packet&);
+		bool _isRetransmission(byte id);
+
+		// Frame parser state, only touched by recieveCommand().
+		byte _frame[WIRE_BUFFER_LENGTH];
+		uint8_t _frameLength, _frameExpected;
+		volatile bool _executing;						// executeCommand() is running a command right now.
+
+		void _parseByte(byte);
+		void _dispatchFrame();
+
+		static Communicator* _instance;				// Target of the Wire handlers.
+		static void _onReceive(int);
+		static void _onRequest();
 };
 
 #endif
@@ -0,0 +1,57 @@
+#ifndef FIXED_H
+	#define FIXED_H
+#include "Arduino.h"
+
+// Q16.16 fixed-point number, replaces float in Motion when MOTION_FIXED_POINT is defined.
+// Range is about +-32767 with a resolution of 1/65536, results that leave it wrap.
+class Fixed
+{
+  int32_t raw;
+
+  // a*b >> 16 from 16 bit halves, avoids a 64 bit multiply on 8 bit processors.
+  // Rounds to nearest, truncated products would pile up in the integrators.
+  static int32_t mul(int32_t a, int32_t b)
+  {
+    bool neg = (a < 0) != (b < 0);
+    uint32_t ua = (a < 0) ? -(uint32_t)a : a;
+    uint32_t ub = (b < 0) ? -(uint32_t)b : b;
+    uint16_t ah = ua >> 16, al = ua, bh = ub >> 16, bl = ub;
+    uint32_t r = (((uint32_t)ah*bh) << 16) + (uint32_t)ah*bl + (uint32_t)al*bh + (((uint32_t)al*bl + 0x8000) >> 16);
+    return neg ? -(int32_t)r : r;
+  }
+
+  public:
+  static const uint8_t FRAC_BITS = 16;
+
+  Fixed(): raw(0) {}
+  Fixed(int v): raw((int32_t)v << FRAC_BITS) {}
+  Fixed(unsigned int v): raw((int32_t)v << FRAC_BITS) {}
+  Fixed(long v): raw((int32_t)v << FRAC_BITS) {}
+  Fixed(float v): raw((v < 0) ? v*65536.0f - 0.5f : v*65536.0f + 0.5f) {}
+  Fixed(double v): raw((v < 0) ? v*65536.0 - 0.5 : v*65536.0 + 0.5) {}
+
+  static Fixed fromRaw(int32_t r) { Fixed f; f.raw = r; return f; }
+  int32_t getRaw() const { return raw; }
+
+  explicit operator float() const { return raw / 65536.0f; }
+  explicit operator long() const { return raw >> FRAC_BITS; }
+
+  Fixed operator-() const { return fromRaw(-raw); }
+  Fixed& operator+=(Fixed b) { raw += b.raw; return *this; }
+  Fixed& operator-=(Fixed b) { raw -= b.raw; return *this; }
+  Fixed& operator*=(Fixed b) { raw = mul(raw, b.raw); return *this; }
+
+  friend Fixed operator+(Fixed a, Fixed b) { return fromRaw(a.raw + b.raw); }
+  friend Fixed operator-(Fixed a, Fixed b) { return fromRaw(a.raw - b.raw); }
+  friend Fixed operator*(Fixed a, Fixed b) { return fromRaw(mul(a.raw, b.raw)); }
+  friend Fixed operator/(Fixed a, long b) { return fromRaw(a.raw / b); }
+
+  friend bool operator==(Fixed a, Fixed b) { return a.raw == b.raw; }
+  friend bool operator!=(Fixed a, Fixed b) { return a.raw != b.raw; }
+  friend bool operator<(Fixed a, Fixed b) { return a.raw < b.raw; }
+  friend bool operator>(Fixed a, Fixed b) { return a.raw > b.raw; }
+  friend bool operator<=(Fixed a, Fixed b) { return a.raw <= b.raw; }
+  friend bool operator>=(Fixed a, Fixed b) { return a.raw >= b.raw; }
+};
+
+#endif
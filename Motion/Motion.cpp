@@ -6,45 +6,90 @@ Wheel::Wheel(uint8_t _int_pin,uint8_t _sign_pin)
 	sign_pin = _sign_pin;
 	pinMode(sign_pin,INPUT);
   pinMode(int_pin, INPUT_PULLUP);
+  set_encoder_count(ENC_COUNT);
 }
 
 void Wheel::encUpdate()
 {
-    micros_last = micros_cur;
-    micros_cur = micros();
-    if(digitalRead(sign_pin))
-    {
-      pos++;
-      dir = 1;
-    }
-    else
-    {
-      pos--;
-      dir = -1;
-    }
+    int8_t d = digitalRead(sign_pin) ? 1 : -1;
+    pos += d;
+
+    // intervals across a reversal say nothing about the speed
+    if(d != dir)
+      valid = 0;
+    dir = d;
+
+    head = (head + 1) & (TICK_RING - 1);
+    stamps[head] = micros();
+    if(valid < TICK_RING)
+      valid++;
 }
 
-float Wheel::getOmega()
+// Blends both classic estimators: at speed it counts the ticks of the last OMEGA_WINDOW
+// over their time span, at low speed it falls back to the period of the last tick.
+// Once the time since the last tick exceeds the measured period, that time bounds the
+// speed, so omega decays smoothly to 0 instead of dropping at a timeout.
+motion_t Wheel::getOmega()
 {
-    if((micros()-micros_cur) > 100000)
+    uint32_t snapshot[TICK_RING];
+    uint8_t h, n;
+    int8_t d;
+
+    noInterrupts();
+    h = head;
+    n = valid;
+    d = dir;
+    for(uint8_t i = 0 ; i < n ; i++)
+      snapshot[i] = stamps[(h - i) & (TICK_RING - 1)];    // newest first
+    interrupts();
+
+    if(n < 2)
       return 0;
-    else
-      return dir*((1000000*2*3.1415/ENC_COUNT)/((double)(micros_cur-micros_last)));
+    uint32_t elapsed = micros() - snapshot[0];
+    if(elapsed > OMEGA_TIMEOUT)
+      return 0;
+
+    // as many intervals as fit into the window, at least one
+    uint8_t k = 1;
+    while(k + 1 < n && snapshot[0] - snapshot[k + 1] <= OMEGA_WINDOW)
+      k++;
+    uint32_t span = snapshot[0] - snapshot[k];
+
+    if(elapsed * k > span)
+      return d*(omega_scale/(long)elapsed);
+    return d*((omega_scale/(long)span)*k);
+}
+
+// pos is 32 bit and updated from the encoder interrupt
+long Wheel::getPos()
+{
+    noInterrupts();
+    long p = pos;
+    interrupts();
+    return p;
 }
 
 void Wheel::flush()
 {
+    noInterrupts();
     pos = 0;
+    interrupts();
 }
 
 void Wheel::set_wheel_radius(float _r)
 {
 	r = _r;
+	ticks_per_meter = ENC_COUNT/(2*PI*r);
 }
 
-void Wheel::set_encoder_count(int _ENC_COUNT)
+bool Wheel::set_encoder_count(int _ENC_COUNT)
 {
+	if(_ENC_COUNT < MIN_ENC_COUNT)
+		return false;
 	ENC_COUNT = _ENC_COUNT;
+	ticks_per_meter = ENC_COUNT/(2*PI*r);
+	omega_scale = 1000000*2*PI/ENC_COUNT;
+	return true;
 }
   
 Motor::Motor(uint8_t _EN,uint8_t _PH)
@@ -55,17 +100,17 @@ Motor::Motor(uint8_t _EN,uint8_t _PH)
 	pinMode(PH,OUTPUT);
 }
 
-void Motor::go(float pwm)
+void Motor::go(motion_t pwm)
 {
   uint8_t direction = 1;
 	if(pwm<0)
   {
 		direction = 0;
-    pwm *= -1;
+    pwm = -pwm;
   }
 	pwm = constrain(pwm,0,255);
 	digitalWrite(PH,direction);
-	analogWrite(EN,pwm);
+	analogWrite(EN,(long)pwm);
 }
 
 void Motor::set_pins(uint8_t _EN,uint8_t _PH)
@@ -81,19 +126,41 @@ void Motor::stop()
     analogWrite(EN,0);
 }
 
-float Pid::getVal(float error)
+// error drives P and I, meas drives D so setpoint steps do not kick the output.
+// ff is scaled by kff and added to the output, e.g. the reference rate of the next loop.
+motion_t Pid::getVal(motion_t error, motion_t meas, motion_t dt, motion_t ff)
 {
-    if(abs(error) <= 10000)  
-      ie = constrain(ie + error,-IE_LIMIT,IE_LIMIT);
-    if(error == 0)
-      ie = 0;
-    val = constrain(((kp*error) + (ki*ie)),-RETURN_LIMIT,RETURN_LIMIT);
+    if(first)
+    {
+      last_meas = meas;
+      first = false;
+    }
+    // first order filter of d(meas)/dt, written without a division by dt
+    d += D_CUTOFF*((meas - last_meas) - d*dt);
+    last_meas = meas;
+
+    iterm = constrain(iterm + ki*(error*dt),-ITERM_LIMIT,ITERM_LIMIT);
+    motion_t u = kp*error + iterm - kd*d + kff*ff;
+
+    motion_t out = constrain(u,-RETURN_LIMIT,RETURN_LIMIT);
+    if(SLEW_LIMIT > 0)
+    {
+      motion_t step = SLEW_LIMIT*dt;
+      out = constrain(out,val - step,val + step);
+    }
+
+    // back-calculation: pull iterm towards what the limited output can deliver
+    iterm = constrain(iterm + kaw*(out - u)*dt,-ITERM_LIMIT,ITERM_LIMIT);
+    val = out;
     return val;
 }
 
 void Pid::flush()
 {
-    ie = 0;
+    iterm = 0;
+    d = 0;
+    val = 0;
+    first = true;
 }
 
 
@@ -104,31 +171,43 @@ void Motion::begin()
 	motor_l = new Motor(M_L_EN,M_L_PH);
 	motor_r = new Motor(M_R_EN,M_R_PH);
  
+  // Integral gains are per second, tuned for a 2 ms tick. kaw = ki/kp.
   pid[4].kp = 200;
-  pid[4].ki = 3;
-  pid[4].IE_LIMIT = 30;
+  pid[4].ki = 1500;
+  pid[4].kaw = 7.5;
+  pid[4].ITERM_LIMIT = 90;
   pid[4].RETURN_LIMIT = 250;
   
   pid[3].kp = 200;
-  pid[3].ki = 3;
-  pid[3].IE_LIMIT = 30;
+  pid[3].ki = 1500;
+  pid[3].kaw = 7.5;
+  pid[3].ITERM_LIMIT = 90;
   pid[3].RETURN_LIMIT = 250;
   
+  // The position loops add the profile's wheel omega to their correction.
   pid[0].kp = 0.02;
-  pid[0].ki = 0.0004;
-  pid[0].IE_LIMIT = 1000;
+  pid[0].ki = 0.2;
+  pid[0].kaw = 10;
+  pid[0].ITERM_LIMIT = 0.4;
+  pid[0].kff = 1;
   pid[0].RETURN_LIMIT = 4;
 
   pid[1].kp = 0.02;
-  pid[1].ki = 0.0004;
-  pid[1].IE_LIMIT = 1000;
+  pid[1].ki = 0.2;
+  pid[1].kaw = 10;
+  pid[1].ITERM_LIMIT = 0.4;
+  pid[1].kff = 1;
   pid[1].RETURN_LIMIT = 4;
 
   pid[2].kp = 0.05;
-  pid[2].ki = 0.0005;
-  pid[2].IE_LIMIT = 1000;
+  pid[2].ki = 0.25;
+  pid[2].kaw = 5;
+  pid[2].ITERM_LIMIT = 0.5;
   pid[2].RETURN_LIMIT = 4;
 
+  half_turn = R*PI*1000;
+  max_cdeg = 18000*MAX_DISTANCE_MM/((long)half_turn + 1);
+  profile.limit(vmax*1000, amax*1000, jmax*1000);
   mode = STOP;
 }
 
@@ -136,6 +215,7 @@ void Motion::stop()
 {
   motor_l->stop();
   motor_r->stop();
+  mode = STOP;
 }
 
 void Motion::flush_all()
@@ -150,90 +230,309 @@ void Motion::flush_all()
     pid[5].flush();
 }
   
-void Motion::move_to(float dis)
+// value*factor as a whole number for a factor >= 0. Tick counts may exceed the Fixed range,
+// so the whole part of value is multiplied apart in 32 bit, as ratio() divides it apart.
+static long scale(motion_t value, motion_t factor)
 {
-    posRefL = dis*(wheel_l->ENC_COUNT/(2*3.1415*wheel_l->r));
-    posRefR = dis*(wheel_r->ENC_COUNT/(2*3.1415*wheel_r->r));
-    mode = MOVE_TO;
-    flush_all();
+#ifdef MOTION_FIXED_POINT
+  int32_t whole = value.getRaw() >> Fixed::FRAC_BITS;
+  int32_t wf = whole * (int32_t)(factor.getRaw() & 0xFFFF);     // |whole| <= 2^15, fits 32 bit
+  int32_t rest = (wf & 0xFFFF) + (Fixed::fromRaw(value.getRaw() & 0xFFFF) * factor).getRaw();
+  return whole * (factor.getRaw() >> Fixed::FRAC_BITS) + (wf >> 16) + (rest >> 16);
+#else
+  return value * factor;
+#endif
 }
 
-void Motion::rotate_to(float angle)
+// value/divisor, the whole part is divided apart so large values stay in the Fixed range
+static motion_t ratio(long value, long divisor)
 {
-    posRefL = angle*R*(wheel_l->ENC_COUNT/(2*3.1416*wheel_l->r));
-    posRefR = -angle*R*(wheel_r->ENC_COUNT/(2*3.1416*wheel_r->r));
-    mode = ROTATE_TO;
+  return motion_t(value / divisor) + motion_t(value % divisor) / divisor;
+}
+
+// tick interval in seconds
+static motion_t to_seconds(uint32_t us)
+{
+#ifdef MOTION_FIXED_POINT
+  return Fixed::fromRaw((us << 10) / 15625);    // us * 2^16 / 10^6
+#else
+  return us * 1e-6;
+#endif
+}
+
+bool Motion::move_to(float dis)
+{
+    if(fabs(dis*1000) > MAX_DISTANCE_MM)
+      return false;
+    start_profile(MOVE_TO, dis*1000, 1, 0);
+    return true;
+}
+
+bool Motion::rotate_to(float angle)
+{
+    if(fabs(angle*R*1000) > MAX_DISTANCE_MM)
+      return false;
+    start_profile(ROTATE_TO, angle*R*1000, -1, 0);
+    return true;
+}
+
+// speed in mm/s, 0 for the profile's vmax. Faster speeds are capped by the profile anyway.
+bool Motion::move_to_mm(long mm, uint16_t speed)
+{
+    if(mm > MAX_DISTANCE_MM || mm < -MAX_DISTANCE_MM)
+      return false;
+    start_profile(MOVE_TO, mm, 1, (speed > MAX_DISTANCE_MM) ? MAX_DISTANCE_MM : speed);
+    return true;
+}
+
+// speed in degree/s, 0 for the profile's vmax
+bool Motion::rotate_to_cdeg(long centidegrees, uint16_t speed)
+{
+    if(centidegrees > max_cdeg || centidegrees < -max_cdeg)
+      return false;
+    if(speed > max_cdeg/100)
+      speed = max_cdeg/100;
+    start_profile(ROTATE_TO, ratio(centidegrees, 18000)*half_turn, -1, ratio(speed, 180)*half_turn);
+    return true;
+}
+
+void Motion::set_profile(float _vmax, float _amax, float _jmax)
+{
+    vmax = _vmax;
+    amax = _amax;
+    jmax = _jmax;
+    profile.limit(vmax*1000, amax*1000, jmax*1000);
+}
+
+// moves the left wheel by distance mm and the right one by _sign_r*distance along a profile
+void Motion::start_profile(uint8_t _mode, motion_t distance, int8_t _sign_r, motion_t speed)
+{
+    ticks_per_mm_l = wheel_l->ticks_per_meter/1000;
+    ticks_per_mm_r = wheel_r->ticks_per_meter/1000;
+    inv_r_l = 1/(wheel_l->r*1000);
+    inv_r_r = 1/(wheel_r->r*1000);
+    sign_r = _sign_r;
+    profile.start(distance, speed);
+    posRefL = posRefR = 0;
+    mode = _mode;
     flush_all();
+    restart_tick();
+}
+
+// advances the profile by one tick and derives the position references and the feed-forward wheel omegas
+void Motion::follow_profile()
+{
+    profile.step(dt);
+    motion_t pos = profile.pos();
+    motion_t vel = profile.vel();
+    posRefL = scale(pos, ticks_per_mm_l);
+    posRefR = sign_r*scale(pos, ticks_per_mm_r);
+    omegaFfL = vel*inv_r_l;
+    omegaFfR = sign_r*(vel*inv_r_r);
+}
+
+void Profile::limit(float _vmax, float _amax, float _jmax)
+{
+    vlimit = _vmax;
+    amax = _amax;
+    jmax = _jmax;
+    inv_2a = 1/(2*_amax);
+    a_over_2j = (_jmax > 0) ? _amax/(2*_jmax) : 0;
+}
+
+void Profile::start(motion_t distance, motion_t _speed)
+{
+    dir = (distance < 0) ? -1 : 1;
+    target = (distance < 0) ? -distance : distance;
+    dist = 0;
+    speed = 0;
+    accel = 0;
+    vmax = (_speed > 0 && _speed < vlimit) ? _speed : vlimit;
+}
+
+bool Profile::step(motion_t dt)
+{
+    motion_t remaining = target - dist;
+    if(remaining <= speed*dt + ARRIVAL)
+    {
+      // the next step reaches the target, or comes closer than fixed point steps can resolve
+      dist = target;
+      speed = 0;
+      accel = 0;
+      return true;
+    }
+
+    // brake once the remaining distance is needed to stop, otherwise head for vmax
+    motion_t braking = speed*(speed*inv_2a) + speed*a_over_2j;
+    motion_t goal = (remaining <= braking) ? motion_t(0) : vmax;
+    motion_t dv = amax*dt;
+    motion_t acc_goal = 0;
+    if(speed + dv < goal)
+      acc_goal = amax;
+    else if(speed > goal + dv)
+      acc_goal = -amax;
+
+    if(jmax > 0)
+    {
+      motion_t da = jmax*dt;
+      accel = constrain(acc_goal,accel - da,accel + da);
+    }
+    else
+      accel = acc_goal;
+
+    speed += accel*dt;
+    if(speed > vmax)
+    {
+      speed = vmax;
+      accel = 0;
+    }
+    else if(speed < 0)
+    {
+      speed = 0;
+      accel = 0;
+    }
+    dist += speed*dt;
+    return false;
 }
 
 void Motion::wheel_omega(float omega_l, float omega_r)
 {
   omegaRefL = omega_l;
   omegaRefR = omega_r;
+  if(mode != WHEEL_OMEGA)
+    restart_tick();
   mode = WHEEL_OMEGA;
 }
+
+void Motion::set_period(uint16_t us)
+{
+  period = us;
+}
+
+void Motion::set_settle_time(uint16_t ms)
+{
+  settle_time = ms;
+}
+
+// first tick of a new motion is due right away and integrates a single period
+void Motion::restart_tick()
+{
+  last_tick = micros() - period;
+  settling = false;
+}
+
+// true once per control period, measures dt and the jitter of the tick
+bool Motion::tick()
+{
+  uint32_t now = micros();
+  uint32_t interval = now - last_tick;
+  if(interval < period)
+    return false;
+
+  uint32_t jitter = interval - period;
+  if(jitter >= period)
+  {
+    tick_stats.overruns++;
+    interval = period;        // do not integrate a stall as one huge step
+  }
+  tick_stats.ticks++;
+  tick_stats.sumJitter += jitter;
+  if(jitter > tick_stats.maxJitter)
+    tick_stats.maxJitter = jitter;
+
+  last_tick = now;
+  dt = to_seconds(interval);
+  return true;
+}
+
+// stops the move once both PWMs stayed small for settle_time
+void Motion::settle()
+{
+  if(abs(pwmR) <= 70 && abs(pwmL) <= 70)
+  {
+    if(!settling)
+    {
+      settling = true;
+      settle_start = millis();
+    }
+    else if(millis() - settle_start >= settle_time)
+    {
+      stop();
+    }
+  }
+  else
+  {
+    settling = false;
+  }
+}
   
+// runs one control tick per period, returns 1 once the motion is done
 uint8_t Motion::updt()
 {
+    if(mode != STOP && !tick())
+      return 0;
+
+    motion_t omegaL, omegaR;
+    long posL = wheel_l->getPos();
+    long posR = wheel_r->getPos();
+
+    // Positions leave the Fixed range after 6.8 m, the loops only see the small
+    // tracking errors. The profile is smooth, so D on the error does not kick.
+    long errL = 0, errR = 0;
+    if(mode == MOVE_TO || mode == ROTATE_TO)
+    {
+      follow_profile();
+      errL = posRefL - posL;
+      errR = posRefR - posR;
+    }
+
     if(mode == MOVE_TO)
     {
-      tmp = pid[2].getVal(wheel_l->pos - wheel_r->pos);
-      omegaRefL = pid[0].getVal(posRefL -(wheel_l->pos)) - tmp;
-      omegaRefR = pid[1].getVal(posRefR -(wheel_r->pos)) + tmp;
+      tmp = pid[2].getVal(posL - posR, dt);
+      omegaRefL = pid[0].getVal(errL, -errL, dt, omegaFfL) - tmp;
+      omegaRefR = pid[1].getVal(errR, -errR, dt, omegaFfR) + tmp;
 
-      pwmL = pid[3].getVal(omegaRefL - wheel_l->getOmega());
-      pwmR = pid[4].getVal(omegaRefR - wheel_r->getOmega());
+      omegaL = wheel_l->getOmega();
+      omegaR = wheel_r->getOmega();
+      pwmL = pid[3].getVal(omegaRefL - omegaL, omegaL, dt, omegaRefL);
+      pwmR = pid[4].getVal(omegaRefR - omegaR, omegaR, dt, omegaRefR);
       
       motor_l->go(pwmL);
       motor_r->go(pwmR);
       
-      if(abs(pwmR) <= 70 && abs(pwmL) <= 70)
-      {
-        if(stability++ >= 1000)
-        {
-          mode = STOP;
-        }
-      }
-      else
-      {
-        stability = 0;
-      }
+      if(profile.done())
+        settle();
       return 0;
     }
 
     else if(mode == ROTATE_TO)
     {
+      tmp = pid[2].getVal((posL + posR)/2, dt);
+      omegaRefL = pid[0].getVal(errL, -errL, dt, omegaFfL) - tmp;
+      omegaRefR = pid[1].getVal(errR, -errR, dt, omegaFfR) - tmp;
 
-      tmp = pid[2].getVal((wheel_l->pos + wheel_r->pos)/2);
-      omegaRefL = pid[0].getVal(posRefL -(wheel_l->pos)) - tmp;
-      omegaRefR = pid[1].getVal(posRefR -(wheel_r->pos)) - tmp;
-
-      pwmL = pid[3].getVal(omegaRefL - wheel_l->getOmega());
-      pwmR = pid[4].getVal(omegaRefR - wheel_r->getOmega());
+      omegaL = wheel_l->getOmega();
+      omegaR = wheel_r->getOmega();
+      pwmL = pid[3].getVal(omegaRefL - omegaL, omegaL, dt, omegaRefL);
+      pwmR = pid[4].getVal(omegaRefR - omegaR, omegaR, dt, omegaRefR);
       
       motor_l->go(pwmL);
       motor_r->go(pwmR);
       
-      if(abs(pwmR) <= 70 && abs(pwmL) <= 70)
-      {
-        if(stability++ >= 1000)
-        {
-          mode = STOP;
-        }
-      }
-      else
-      {
-        stability = 0;
-      }
+      if(profile.done())
+        settle();
       return 0;
     }
 
     else if(mode == WHEEL_OMEGA)
     {
-      pwmL = pid[3].getVal(omegaRefL - wheel_l->getOmega());
+      omegaL = wheel_l->getOmega();
+      omegaR = wheel_r->getOmega();
+      pwmL = pid[3].getVal(omegaRefL - omegaL, omegaL, dt, omegaRefL);
       motor_l->go(pwmL);
-      pwmR = pid[4].getVal(omegaRefR - wheel_r->getOmega());
+      pwmR = pid[4].getVal(omegaRefR - omegaR, omegaR, dt, omegaRefR);
       motor_r->go(pwmR);
+      return 0;
     }
     
     else
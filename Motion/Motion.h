@@ -2,27 +2,52 @@
 	#define MOTION_H
 #include "Arduino.h"
 
+// Uncomment to run the controllers and the omega estimator in Q16.16 fixed point instead of float
+//#define MOTION_FIXED_POINT
+
+#ifdef MOTION_FIXED_POINT
+  #include "Fixed.h"
+  typedef Fixed motion_t;
+#else
+  typedef float motion_t;
+#endif
+
 class Wheel
 {
-  volatile int dir;
-  volatile long micros_last=0;
-  volatile long micros_cur=2000000;
-  volatile float last_omega = 0;
-  volatile float omega = 0;
+  static const uint8_t TICK_RING = 8;           // timestamps kept, power of two
+  static const uint32_t OMEGA_WINDOW = 10000;   // us, ticks averaged by getOmega() at speed
+  static const uint32_t OMEGA_TIMEOUT = 200000; // us without a tick before the wheel counts as stopped
+
+  // written by encUpdate() from the encoder interrupt, read as a snapshot
+  volatile int8_t dir = 0;
+  volatile uint32_t stamps[TICK_RING];
+  volatile uint8_t head = 0;                    // newest timestamp
+  volatile uint8_t valid = 0;                   // timestamps since the last reversal, at most TICK_RING
 
   public:
+  static const int DEFAULT_ENC_COUNT = 960;
+#ifdef MOTION_FIXED_POINT
+  static const int MIN_ENC_COUNT = 192;         // omega_scale = 2*PI*10^6/ENC_COUNT leaves the Q16.16 range below
+#else
+  static const int MIN_ENC_COUNT = 1;
+#endif
+  static_assert(DEFAULT_ENC_COUNT >= MIN_ENC_COUNT, "DEFAULT_ENC_COUNT is below MIN_ENC_COUNT");
+
   uint8_t int_pin;
   uint8_t sign_pin;
-  int ENC_COUNT = 960;
+  int ENC_COUNT = DEFAULT_ENC_COUNT;
   float r = 0.0318;
+  float ticks_per_meter;      // precomputed from r and ENC_COUNT by the setters
+  motion_t omega_scale;       // rad/s times the tick interval in us
   volatile long pos=0;
 
   Wheel(uint8_t _int_pin,uint8_t _sign_pin);
   void encUpdate();
-  float getOmega();
+  motion_t getOmega();
+  long getPos();
   void flush();
   void set_wheel_radius(float _r);
-  void set_encoder_count(int _ENC_COUNT);
+  bool set_encoder_count(int _ENC_COUNT);     // false and unchanged below MIN_ENC_COUNT
 };
 
 class Motor
@@ -35,24 +60,70 @@ class Motor
 
   Motor(uint8_t _EN, uint8_t _PH);
   void set_pins(uint8_t _EN, uint8_t _PH);
-  void go(float pwm);
+  void go(motion_t pwm);
   void stop();
 };
 
+// PID with derivative on measurement, back-calculation anti-windup, slew limit and feed-forward.
+// No allocation, a handful of multiplies per call.
 class Pid
 {
-  float val = 0;
+  motion_t val = 0;
+  motion_t d = 0;           // filtered derivative of the measurement, per second
+  motion_t last_meas = 0;
+  bool first = true;
   public:
-  float kp = 0.2;
-  float ki = 0.1;
-  float ie = 0;
-  float IE_LIMIT = 0.5;
-  float RETURN_LIMIT = 255;
+  motion_t kp = 0.2;
+  motion_t ki = 0.1;        // per second
+  motion_t kd = 0;          // seconds, acts on the measurement only
+  motion_t kff = 0;         // gain of the feed-forward input
+  motion_t kaw = 0;         // back-calculation gain per second, bleeds iterm while the output is limited
+  motion_t D_CUTOFF = 50;   // rad/s, derivative filter, D_CUTOFF*dt must stay below 1
+  motion_t iterm = 0;       // integral term, in output units
+  motion_t ITERM_LIMIT = 0.05;
+  motion_t RETURN_LIMIT = 255;
+  motion_t SLEW_LIMIT = 0;  // largest output change per second, 0 for none
 
-  float getVal(float error);
+  motion_t getVal(motion_t error, motion_t meas, motion_t dt, motion_t ff = 0);
+  motion_t getVal(motion_t error, motion_t dt) { return getVal(error, -error, dt); }   // regulates error to 0
   void flush();
 };
 
+// Trapezoidal or jerk limited (S-curve) motion profile, advanced by one step per control tick.
+// Distances in mm of wheel travel, so a step of speed*dt keeps enough fixed point digits at low speed.
+// The limits are converted once by limit(), start() takes no float.
+class Profile
+{
+  motion_t target = 0;      // distance of the move, always positive
+  motion_t dist = 0;        // travelled along the profile so far
+  motion_t speed = 0;
+  motion_t accel = 0;
+  int8_t dir = 1;
+  motion_t vmax = 0;        // of the current move
+  motion_t vlimit = 0;
+  motion_t amax = 0;
+  motion_t jmax = 0;
+  motion_t inv_2a = 0;      // 1/(2*amax)
+  motion_t a_over_2j = 0;   // amax/(2*jmax), extra braking distance per mm/s while the jerk ramps
+  const motion_t ARRIVAL = 0.1;     // mm, well below one encoder tick
+  public:
+  void limit(float _vmax, float _amax, float _jmax);
+  void start(motion_t distance, motion_t _speed);   // _speed 0 or above the limit moves at vmax
+  bool step(motion_t dt);   // true once the target is reached
+  bool done() { return dist == target; }
+  motion_t pos() { return (dir > 0) ? dist : -dist; }
+  motion_t vel() { return (dir > 0) ? speed : -speed; }
+};
+
+// Timing of the control tick, see Motion::updt()
+struct Tick_Stats
+{
+  uint32_t ticks = 0;
+  uint32_t overruns = 0;      // ticks started more than a whole period late
+  uint32_t maxJitter = 0;     // largest deviation of a tick interval from the period, in us
+  uint32_t sumJitter = 0;     // sum of all deviations, divide by ticks for the mean
+};
+
 
 class Motion
 {
@@ -68,17 +139,46 @@ class Motion
 	const int MOVE_TO = 1;
 	const int ROTATE_TO = 2;
   const int WHEEL_OMEGA = 3;
-	int stability = 0;
+	const uint16_t CONTROL_PERIOD = 2000;	// us, the gains in begin() are tuned to it
+	const uint16_t SETTLE_TIME = 500;		// ms with small PWM before a move counts as done
+	uint16_t period = CONTROL_PERIOD;
+	uint16_t settle_time = SETTLE_TIME;
+	bool settling = false;
+	uint32_t settle_start = 0;
+	uint32_t last_tick = 0;
+	motion_t dt = 0;
+	Tick_Stats tick_stats;
 	long posRefL=0;
 	long posRefR=0;
-	float omegaRefL=0;
-	float omegaRefR=0;
+	motion_t omegaRefL=0;
+	motion_t omegaRefR=0;
 	uint8_t mode = 0;
-	float pwmL=0;
-	float pwmR=0;
-  float tmp;
+	motion_t pwmL=0;
+	motion_t pwmR=0;
+  motion_t tmp;
   float R = 0.135;
+  float vmax = 0.1;         // m/s of wheel travel, profile limits of moves and turns
+  float amax = 0.3;         // m/s^2
+  float jmax = 2;           // m/s^3, 0 for trapezoidal profiles
+  Profile profile;
+  int8_t sign_r = 1;        // right wheel travel relative to the left, -1 when turning
+  motion_t half_turn;       // mm of wheel travel per half turn of the bot, R*PI
+  long max_cdeg;            // longest turn whose wheel travel stays within MAX_DISTANCE_MM
+  motion_t ticks_per_mm_l, ticks_per_mm_r;
+  motion_t inv_r_l, inv_r_r; // rad per mm of wheel travel
+  motion_t omegaFfL = 0;
+  motion_t omegaFfR = 0;
+
+  void start_profile(uint8_t _mode, motion_t distance, int8_t _sign_r, motion_t speed);
+  void follow_profile();
+  bool tick();
+  void restart_tick();
+  void settle();
   public:
+	// Longest move in mm and longest wheel travel of a turn. The Q16.16 profile wraps
+	// beyond 32767 mm, the float build keeps the same limit.
+	static const long MAX_DISTANCE_MM = 32000;
+
 	Pid pid[6];
 	Wheel* wheel_l;
 	Wheel* wheel_r;
@@ -88,11 +188,23 @@ class Motion
 	void begin();
   void stop();
 	void flush_all();
-	void move_to(float dis);
-	void rotate_to(float angle);
+	// The moves and turns return false and leave the motors alone beyond MAX_DISTANCE_MM of wheel travel.
+	bool move_to(float dis);
+	bool rotate_to(float angle);
+	bool move_to_mm(long mm, uint16_t speed = 0);
+	bool rotate_to_cdeg(long centidegrees, uint16_t speed = 0);
+	void set_profile(float _vmax, float _amax, float _jmax);
   void wheel_omega(float omega_l,float omega_r);
 	uint8_t updt();
+	void set_period(uint16_t us);
+	void set_settle_time(uint16_t ms);
+	const Tick_Stats& getTickStats() { return tick_stats; }
+	void resetTickStats() { tick_stats = Tick_Stats(); }
 	uint8_t getMode() { return mode; }
+	float getPwmL() { return (float)pwmL; }
+	float getPwmR() { return (float)pwmR; }
+	long getPosRefL() { return posRefL; }   // ticks, where the profile wants the wheel now
+	long getPosRefR() { return posRefR; }
 };
 
 #endif
@@ -0,0 +1,41 @@
+/**
+ *  Cycle counting for the host benchmarks.
+ *
+ *  Uses the time stamp counter on x86 and nanoseconds elsewhere. The host has a
+ *  floating point unit and a deep pipeline, so the counts compare two variants of
+ *  the same code on the host; they are not AVR cycles.
+ */
+
+#ifndef Bench_h
+#define Bench_h
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	static const char* COUNTER_UNIT = "cycles";
+	static inline uint64_t counter() { return __rdtsc(); }
+#else
+	static const char* COUNTER_UNIT = "ns";
+	static inline uint64_t counter() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+#endif
+
+/** Median over runs of the cost of one body(i) call, each run making calls calls. */
+template <class Body> double medianCost(uint16_t calls, uint8_t runs, Body body)
+{
+	double costs[32];
+	if(runs > 32) runs = 32;
+	for(uint8_t r = 0 ; r < runs ; r++)
+	{
+		uint64_t start = counter();
+		for(uint16_t i = 0 ; i < calls ; i++)
+			body(i);
+		costs[r] = (double)(counter() - start) / calls;
+	}
+	std::sort(costs, costs + runs);
+	return costs[runs / 2];
+}
+
+#endif
@@ -0,0 +1,52 @@
+/**
+ *  Minimal checks for the host tests, a failed check is reported and counted.
+ */
+
+#ifndef Check_h
+#define Check_h
+
+#include <stdio.h>
+
+inline int& checkFailures()
+{
+	static int failures = 0;
+	return failures;
+}
+
+#define CHECK(condition) \
+	do { \
+		if(!(condition)) \
+		{ \
+			printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			checkFailures()++; \
+		} \
+	} while(0)
+
+#define CHECK_EQUAL(expected, actual) \
+	do { \
+		long _e = (long)(expected), _a = (long)(actual); \
+		if(_e != _a) \
+		{ \
+			printf("%s:%d: CHECK_EQUAL(%s, %s) failed, %ld != %ld\n", __FILE__, __LINE__, #expected, #actual, _e, _a); \
+			checkFailures()++; \
+		} \
+	} while(0)
+
+#define CHECK_CLOSE(expected, actual, tolerance) \
+	do { \
+		double _e = (double)(expected), _a = (double)(actual); \
+		if(_a < _e - (tolerance) || _a > _e + (tolerance)) \
+		{ \
+			printf("%s:%d: CHECK_CLOSE(%s, %s) failed, %g != %g\n", __FILE__, __LINE__, #expected, #actual, _e, _a); \
+			checkFailures()++; \
+		} \
+	} while(0)
+
+/** Prints the outcome of the test program, returns its exit code. */
+inline int checkReport(const char* name)
+{
+	printf("%s: %s\n", name, checkFailures() ? "FAILED" : "ok");
+	return checkFailures() ? 1 : 0;
+}
+
+#endif
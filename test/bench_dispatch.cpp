@@ -0,0 +1,126 @@
+/**
+ *  Cost of decoding and dispatching one command on the slave.
+ *
+ *  Decodes version 1 draw frames into a Command_Packet and runs them through the
+ *  slave's dispatch table, _lookup() and _execute(), against the switch over the
+ *  command byte the slave had before. The original switch also allocated each
+ *  Command_Packet on the heap, it is timed with and without that allocation.
+ *  Frame parsing, the command queue and the bookkeeping of executeCommand() are
+ *  the same for both and left out.
+ *
+ *  The table is faster than the original heap allocating switch. Against a
+ *  switch on the stack its few extra cycles buy the arity check, which rejects
+ *  commands carrying stray Parameters, and a single row per command.
+ */
+
+#include <stdio.h>
+
+#include "Bench.h"
+#include "Communicators.h"
+
+typedef master::Command_Packet::Commands Commands;
+
+static const uint16_t CALLS = 10000;
+static const uint8_t RUNS = 15;
+
+namespace slave {
+
+/** Reaches the private dispatch of the slave Communicator. */
+class Dispatch_Probe
+{
+	public:
+		static bool execute(Communicator& c, const Command_Packet& cp) { return c._execute(cp); }
+};
+
+}
+
+// The dispatch of the slave before the tables.
+static bool switchDispatch(GraphicEngine& ge, const slave::Command_Packet& cp)
+{
+	switch(cp._command)
+	{
+		case Commands::DrawPoint:
+			ge.drawPixel(cp.Parameter[0], cp.Parameter[1]);
+			break;
+		case Commands::DrawLine:
+			ge.drawLine(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2], cp.Parameter[3]);
+			break;
+		case Commands::DrawCircle:
+			ge.drawCircle(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2]);
+			break;
+		case Commands::DrawDisc:
+			ge.drawDisc(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2]);
+			break;
+		case Commands::DrawTriangle:
+			ge.drawTriangle(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2], cp.Parameter[3], cp.Parameter[4], cp.Parameter[5]);
+			break;
+		case Commands::DrawRectangle:
+			ge.drawRectangle(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2], cp.Parameter[3]);
+			break;
+		case Commands::DrawBox:
+			ge.drawBox(cp.Parameter[0], cp.Parameter[1], cp.Parameter[2], cp.Parameter[3]);
+			break;
+		case Commands::ClearScreen:
+			ge.clear();
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+/** A draw command and the Parameters it takes, the others stay 0. */
+struct Draw
+{
+	Commands::Commands_Enum command;
+	uint8_t arity;
+};
+
+static const Draw WORKLOAD[] = {
+	{ Commands::DrawPoint, 2 }, { Commands::DrawLine, 4 }, { Commands::DrawCircle, 3 }, { Commands::DrawBox, 4 },
+	{ Commands::DrawTriangle, 6 }, { Commands::DrawDisc, 3 }, { Commands::DrawRectangle, 4 }, { Commands::ClearScreen, 0 },
+};
+static const uint8_t WORKLOAD_LENGTH = sizeof(WORKLOAD) / sizeof(WORKLOAD[0]);
+
+static byte frames[WORKLOAD_LENGTH][Protocol::COMMAND_LENGTH];
+static volatile bool sink;
+
+int main()
+{
+	for(uint8_t c = 0 ; c < WORKLOAD_LENGTH ; c++)
+	{
+		master::Command_Packet cp(c + 1, WORKLOAD[c].command);
+		for(uint8_t i = 0 ; i < WORKLOAD[c].arity ; i++)
+			cp.Parameter[i] = 10 * (i + 1);
+		cp.GetPacketBytes(frames[c], 1);
+	}
+
+	GraphicEngine ge;
+	Motion motors;
+	TwoWire slaveWire;
+	slave::Communicator table(ge, motors, slaveWire);
+	uint16_t errors = 0;
+
+	double switchHeap = medianCost(CALLS, RUNS, [&](uint16_t i) {
+		slave::Command_Packet* cp = new slave::Command_Packet(frames[i % WORKLOAD_LENGTH], false);
+		sink = switchDispatch(ge, *cp);
+		delete cp;
+	});
+	double switchStack = medianCost(CALLS, RUNS, [&](uint16_t i) {
+		slave::Command_Packet cp(frames[i % WORKLOAD_LENGTH], false);
+		sink = switchDispatch(ge, cp);
+	});
+	double tableCost = medianCost(CALLS, RUNS, [&](uint16_t i) {
+		slave::Command_Packet cp(frames[i % WORKLOAD_LENGTH], false);
+		bool ok = slave::Dispatch_Probe::execute(table, cp);
+		if(!ok) errors++;
+		sink = ok;
+	});
+
+	printf("%u draw commands, median of %u runs, %s per decode and dispatch\n", CALLS, RUNS, COUNTER_UNIT);
+	printf("switch, heap Command_Packet  %8.1f\n", switchHeap);
+	printf("switch                       %8.1f\n", switchStack);
+	printf("dispatch table               %8.1f\n", tableCost);
+	printf("command errors %u\n", errors);
+	return 0;
+}
@@ -0,0 +1,213 @@
+/**
+ *  Throughput and latency of the master/slave link over the simulated bus.
+ *
+ *  Streams draw and motion commands through submit()/poll() and reports commands
+ *  per second of simulated time and the p50/p99 latency from submit() to the final
+ *  status, at 100 and 400 kHz, without and with bus faults. Commands the slave
+ *  completes as it executes them, draws and the Drive, Move, Turn and Stop
+ *  commands of the drive workload, are reported apart from the MoveMillimeters
+ *  and MoveDistance moves of the motion workload. Those stay in progress until
+ *  the robot arrived; the host wheels do not turn, so the benchmark lets every
+ *  move arrive TRAVEL_TIME after it started. Draws queued behind a waiting move
+ *  wait for it as well. The slave acknowledges a command only once it executed
+ *  it, so with bus faults the master also retransmits those draws until the move
+ *  ahead of them arrived, which the retries of the noisy motion rows count.
+ *
+ *  Then sends draw commands through the blocking API, once paced by the fixed
+ *  COMMAND_DELAY hold-off and once by the slave's acknowledges.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "Loopback.h"
+
+typedef master::Communicator::Poll_Result Poll_Result;
+typedef master::Command_Packet::Commands Commands;
+
+static const uint16_t COMMANDS = 2000;
+static const uint16_t BLOCKING_COMMANDS = 200;
+static const uint16_t TRAVEL_TIME = 20;					// ms every move takes, 4 mm at 200 mm/s or 1 cm at 50 cm/s.
+
+struct Workload_Command
+{
+	Commands::Commands_Enum command;
+	byte p[Protocol::PARAMETER_COUNT];
+};
+
+static const Workload_Command DRAW[] = {
+	{ Commands::DrawLine, { 0, 0, 127, 63 } },
+	{ Commands::DrawCircle, { 64, 32, 20 } },
+	{ Commands::DrawBox, { 10, 10, 8, 8 } },
+	{ Commands::DrawPoint, { 5, 5 } },
+};
+
+static const Workload_Command DRIVE[] = {
+	{ Commands::DrawLine, { 0, 0, 127, 63 } },
+	{ Commands::Drive, { 1, 120, 1, 100 } },
+	{ Commands::DrawCircle, { 64, 32, 20 } },
+	{ Commands::Move, { 1, 200 } },
+	{ Commands::DrawBox, { 10, 10, 8, 8 } },
+	{ Commands::Turn, { 0, 80 } },
+	{ Commands::DrawPoint, { 5, 5 } },
+	{ Commands::Stop, { } },
+};
+
+static const Workload_Command MOTION[] = {
+	{ Commands::DrawLine, { 0, 0, 127, 63 } },
+	{ Commands::MoveMillimeters, { 4, 0, 0, 0, 200, 0 } },
+	{ Commands::DrawCircle, { 64, 32, 20 } },
+	{ Commands::DrawBox, { 10, 10, 8, 8 } },
+	{ Commands::DrawPoint, { 5, 5 } },
+	{ Commands::MoveDistance, { 1, 1, 50 } },
+	{ Commands::DrawLine, { 127, 0, 0, 63 } },
+	{ Commands::DrawDisc, { 64, 32, 6 } },
+};
+
+struct Faults
+{
+	const char* name;
+	float dropRate, corruptRate;
+};
+
+static uint32_t percentile(std::vector<uint32_t>& sorted, uint8_t p)
+{
+	if(sorted.empty()) return 0;
+	return sorted[(sorted.size() - 1) * p / 100];
+}
+
+// true for the commands that complete once the robot arrived
+static bool isMove(Commands::Commands_Enum command)
+{
+	return command == Commands::MoveDistance || command == Commands::MoveMillimeters
+		|| command == Commands::TurnAngle || command == Commands::TurnCentidegrees;
+}
+
+static void run(const char* name, const Workload_Command* workload, uint8_t length, uint32_t clock, const Faults& faults)
+{
+	static Loopback link;
+	link.begin(clock);
+	link.master.setFlowControl(true);
+	link.master.setReliable(faults.dropRate > 0 || faults.corruptRate > 0, 5);
+	TwoWire::bus.dropRate = faults.dropRate;
+	TwoWire::bus.corruptRate = faults.corruptRate;
+
+	struct Outstanding { master::Command_Handle handle; uint32_t start; bool move; };
+	Outstanding outstanding[8];
+	uint8_t count = 0;
+	std::vector<uint32_t> latencies, moveLatencies;
+	uint16_t failed = 0;
+	bool travelling = false;
+	uint32_t departure = 0;
+
+	uint32_t start = micros();
+	uint16_t sent = 0;
+	while(sent < COMMANDS || count > 0)
+	{
+		if(sent < COMMANDS && count < 8)
+		{
+			const Workload_Command& c = workload[sent % length];
+			uint32_t now = micros();
+			master::Command_Handle h = link.master.submit(c.command, c.p[0], c.p[1], c.p[2], c.p[3], c.p[4], c.p[5]);
+			if(h.valid)
+			{
+				outstanding[count].handle = h;
+				outstanding[count].start = now;
+				outstanding[count].move = isMove(c.command);
+				count++;
+				sent++;
+			}
+		}
+		link.master.poll();
+
+		// MOVE_TO and ROTATE_TO, see Telemetry Packet Structure. The robot arrives, the slave's Motion settles.
+		uint8_t mode = link.motors.getMode();
+		if(mode != 1 && mode != 2)
+			travelling = false;
+		else if(!travelling)
+		{
+			travelling = true;
+			departure = millis();
+		}
+		else if(millis() - departure >= TRAVEL_TIME)
+		{
+			link.motors.stop();
+			travelling = false;
+		}
+
+		for(uint8_t i = 0 ; i < count ; )
+		{
+			Poll_Result::Poll_Result_Enum result = link.master.status(outstanding[i].handle);
+			if(result == Poll_Result::Pending)
+			{
+				i++;
+				continue;
+			}
+			if(result == Poll_Result::Ok)
+				(outstanding[i].move ? moveLatencies : latencies).push_back(micros() - outstanding[i].start);
+			else
+				failed++;
+			outstanding[i] = outstanding[--count];
+		}
+	}
+	uint32_t elapsed = micros() - start;
+
+	std::sort(latencies.begin(), latencies.end());
+	std::sort(moveLatencies.begin(), moveLatencies.end());
+	printf("%-6s %4lu kHz  %-5s %8.1f cmd/s   p50 %6lu us   p99 %6lu us",
+		name, (unsigned long)(clock / 1000), faults.name,
+		COMMANDS * 1e6 / elapsed,
+		(unsigned long)percentile(latencies, 50), (unsigned long)percentile(latencies, 99));
+	if(!moveLatencies.empty())
+		printf("   moves p50 %6lu us   p99 %6lu us",
+			(unsigned long)percentile(moveLatencies, 50), (unsigned long)percentile(moveLatencies, 99));
+	printf("   failed %u   retries %u\n", failed, link.master.stats().retries);
+}
+
+static void runBlocking(bool flowControl, uint32_t clock)
+{
+	static Loopback link;
+	link.begin(clock);
+	link.master.setFlowControl(flowControl);
+
+	uint32_t start = micros();
+	for(uint16_t i = 0 ; i < BLOCKING_COMMANDS ; i += 4)
+	{
+		link.master.drawLine(0, 0, 127, 63);
+		link.master.drawCircle(64, 32, 20);
+		link.master.drawBox(10, 10, 8, 8);
+		link.master.drawPoint(5, 5);
+	}
+	uint32_t elapsed = micros() - start;
+	delay(50);											// The slave executes the last command.
+
+	printf("%-14s %4lu kHz  %8.1f cmd/s   drawn %u\n",
+		flowControl ? "acknowledges" : "fixed delay", (unsigned long)(clock / 1000),
+		BLOCKING_COMMANDS * 1e6 / elapsed, link.ge.shapes);
+}
+
+int main()
+{
+	const Faults clean = { "clean", 0, 0 };
+	const Faults noisy = { "noisy", 0.001, 0.002 };
+	const uint32_t clocks[] = { 100000, 400000 };
+
+	printf("%u commands through submit()/poll() with flow control, simulated time\n", COMMANDS);
+	for(uint8_t c = 0 ; c < 2 ; c++)
+	{
+		run("draw", DRAW, sizeof(DRAW) / sizeof(DRAW[0]), clocks[c], clean);
+		run("drive", DRIVE, sizeof(DRIVE) / sizeof(DRIVE[0]), clocks[c], clean);
+		run("drive", DRIVE, sizeof(DRIVE) / sizeof(DRIVE[0]), clocks[c], noisy);
+		run("motion", MOTION, sizeof(MOTION) / sizeof(MOTION[0]), clocks[c], clean);
+		run("motion", MOTION, sizeof(MOTION) / sizeof(MOTION[0]), clocks[c], noisy);
+	}
+
+	printf("\n%u draw commands through the blocking draw methods, simulated time\n", BLOCKING_COMMANDS);
+	for(uint8_t c = 0 ; c < 2 ; c++)
+	{
+		runBlocking(false, clocks[c]);
+		runBlocking(true, clocks[c]);
+	}
+	return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ *  Cost of the control arithmetic in the float and the fixed point build of Motion.
+ *
+ *  Counts host cycles per call of Pid::getVal(), Wheel::getOmega() and one whole
+ *  MOVE_TO tick of Motion::updt(). The host has a floating point unit while the
+ *  ATmega emulates float in software, so these numbers compare the two builds on
+ *  the host only and do not predict the AVR.
+ */
+
+#include <stdio.h>
+
+#include "Bench.h"
+#include "Motions.h"
+
+static const uint16_t CALLS = 10000;
+static const uint8_t RUNS = 15;
+
+static volatile float sink;
+
+template <class Body> static double measure(Body body)
+{
+	return medianCost(CALLS, RUNS, body);
+}
+
+static void report(const char* name, double f, double x)
+{
+	printf("%-22s %8.1f %8.1f %7.2fx\n", name, f, x, f / x);
+}
+
+template <class Pid_T, class T> static double pidCost()
+{
+	Pid_T pid;
+	pid.kp = 200;
+	pid.ki = 1500;
+	pid.kaw = 7.5;
+	pid.ITERM_LIMIT = 90;
+	pid.RETURN_LIMIT = 250;
+	const T dt = 0.002f;
+	T inputs[16];
+	for(uint8_t i = 0 ; i < 16 ; i++)
+		inputs[i] = (float)(3 * sin(i * 0.4));
+	return measure([&](uint16_t i) {
+		T meas = inputs[i & 15];
+		sink = (float)pid.getVal(inputs[(i + 3) & 15] - meas, meas, dt, inputs[(i + 3) & 15]);
+	});
+}
+
+// The wheel ticks every 500 us, the host clock's own cost is in both builds.
+template <class Wheel_T> static double omegaCost()
+{
+	Simulation::reset();
+	Wheel_T wheel(2, 16);
+	for(uint8_t t = 0 ; t < 8 ; t++)
+	{
+		Simulation::advance(500);
+		wheel.encUpdate();
+	}
+	return measure([&](uint16_t) {
+		sink = (float)wheel.getOmega();
+	});
+}
+
+// A long move, each call is due as one control tick.
+template <class Motion_T> static double tickCost()
+{
+	Simulation::reset();
+	static Motion_T motion;
+	motion.begin();
+	motion.move_to_mm(30000);
+	return measure([&](uint16_t) {
+		Simulation::advance(2000);
+		motion.updt();
+	});
+}
+
+int main()
+{
+	printf("%u calls, median of %u runs, %s per call\n", CALLS, RUNS, COUNTER_UNIT);
+	printf("%-22s %8s %8s %8s\n", "", "float", "fixed", "ratio");
+	report("Pid::getVal", pidCost<flt::Pid, flt::motion_t>(), pidCost<fix::Pid, fix::motion_t>());
+	report("Wheel::getOmega", omegaCost<flt::Wheel>(), omegaCost<fix::Wheel>());
+	report("Motion::updt MOVE_TO", tickCost<flt::Motion>(), tickCost<fix::Motion>());
+	return 0;
+}
@@ -0,0 +1,131 @@
+/**
+ *  Host stand-in for the Arduino core, see Arduino.h.
+ */
+
+#include "Arduino.h"
+
+#include <stdio.h>
+
+HardwareSerial Serial;
+
+// Reading the clock costs about a microsecond on the AVR, and it lets busy waits make progress.
+unsigned long micros()
+{
+	Simulation::advance(1);
+	return Simulation::now();
+}
+
+unsigned long millis()
+{
+	return micros() / 1000;
+}
+
+void delay(unsigned long ms)
+{
+	while(ms--)
+		delayMicroseconds(1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	// In steps, so the other processor keeps up with a long delay.
+	while(us > Simulation::QUANTUM)
+	{
+		Simulation::advance(Simulation::QUANTUM);
+		us -= Simulation::QUANTUM;
+	}
+	Simulation::advance(us);
+}
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return LOW; }
+int analogRead(uint8_t) { return 0; }
+void analogWrite(uint8_t, int) {}
+void attachInterrupt(uint8_t, void (*)(void), int) {}
+
+static uint32_t _seed = 1;
+
+long random(long max)
+{
+	if(max <= 0) return 0;
+	_seed = _seed * 1103515245 + 12345;
+	return (_seed >> 8) % max;
+}
+
+long random(long min, long max)
+{
+	if(min >= max) return min;
+	return random(max - min) + min;
+}
+
+void randomSeed(unsigned long seed)
+{
+	if(seed != 0) _seed = seed;
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+	return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+//------------------------------------------------------------------
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+	size_t n = 0;
+	while(size--)
+		n += write(*buffer++);
+	return n;
+}
+
+size_t Print::_printNumber(unsigned long n, uint8_t base)
+{
+	char buf[8 * sizeof(long) + 1];
+	char* str = &buf[sizeof(buf) - 1];
+	*str = '\0';
+	if(base < 2) base = 10;
+	do {
+		char c = n % base;
+		n /= base;
+		*--str = (c < 10) ? c + '0' : c + 'A' - 10;
+	} while(n);
+	return print(str);
+}
+
+size_t Print::print(const char* str) { return write((const uint8_t*)str, strlen(str)); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(unsigned char b, int base) { return print((unsigned long)b, base); }
+size_t Print::print(int n, int base) { return print((long)n, base); }
+size_t Print::print(unsigned int n, int base) { return print((unsigned long)n, base); }
+
+size_t Print::print(long n, int base)
+{
+	if(base == DEC && n < 0)
+		return print('-') + _printNumber(-n, DEC);
+	return _printNumber(n, base);
+}
+
+size_t Print::print(unsigned long n, int base) { return _printNumber(n, base); }
+
+size_t Print::print(double number, int digits)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.*f", digits, number);
+	return print(buf);
+}
+
+size_t Print::println() { return write((const uint8_t*)"\r\n", 2); }
+size_t Print::println(const char* str) { return print(str) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char b, int base) { return print(b, base) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned int n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+size_t Print::println(double number, int digits) { return print(number, digits) + println(); }
+
+size_t HardwareSerial::write(uint8_t c)
+{
+	return fputc(c, stdout) == EOF ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+/**
+ *  Host stand-in for the Arduino core, just enough to build the libraries on Linux.
+ *
+ *  Time is simulated, see Simulation.h. Pins do nothing, PROGMEM is ordinary memory.
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Simulation.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define HEX 16
+#define DEC 10
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+#define HIGH 0x1
+#define LOW 0x0
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define PI 3.1415926535897932384626433832795
+#define _BV(bit) (1 << (bit))
+#define abs(x) ((x)>0?(x):-(x))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+#define PROGMEM
+#define F(string_literal) (string_literal)
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define memcpy_P memcpy
+
+// Keeps the other processor, and the bus handlers it triggers, out of a critical section.
+#define noInterrupts() Simulation::hold()
+#define interrupts() Simulation::release()
+#define digitalPinToInterrupt(p) (p)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+class Print
+{
+	public:
+		virtual ~Print() {}
+		virtual size_t write(uint8_t) = 0;
+		virtual size_t write(const uint8_t* buffer, size_t size);
+
+		size_t print(const char*);
+		size_t print(char);
+		size_t print(unsigned char, int = DEC);
+		size_t print(int, int = DEC);
+		size_t print(unsigned int, int = DEC);
+		size_t print(long, int = DEC);
+		size_t print(unsigned long, int = DEC);
+		size_t print(double, int = 2);
+
+		size_t println();
+		size_t println(const char*);
+		size_t println(char);
+		size_t println(unsigned char, int = DEC);
+		size_t println(int, int = DEC);
+		size_t println(unsigned int, int = DEC);
+		size_t println(long, int = DEC);
+		size_t println(unsigned long, int = DEC);
+		size_t println(double, int = 2);
+
+	private:
+		size_t _printNumber(unsigned long, uint8_t base);
+};
+
+class Stream : public Print
+{
+	public:
+		virtual int available() = 0;
+		virtual int read() = 0;
+		virtual int peek() = 0;
+};
+
+/** Writes to stdout. */
+class HardwareSerial : public Stream
+{
+	public:
+		void begin(unsigned long) {}
+		size_t write(uint8_t);
+		int available() { return 0; }
+		int read() { return -1; }
+		int peek() { return -1; }
+		using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif
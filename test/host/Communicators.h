@@ -0,0 +1,28 @@
+/**
+ *  Master and Slave Communicator side by side in one host program.
+ *
+ *  Both libraries name their classes Communicator, Command_Packet and so on, which is fine
+ *  on two processors but not in one program. The host build compiles each library
+ *  inside its own namespace, see Master_Unit.cpp and Slave_Unit.cpp.
+ */
+
+#ifndef Communicators_h
+#define Communicators_h
+
+// Shared headers first, their include guards keep them out of the namespaces.
+#include "Arduino.h"
+#include "Wire.h"
+#include "Protocol.h"
+#include "Motion.h"
+#include "U8g2_GraphicsEngine.h"
+
+namespace slave {
+#include "Slave.h"
+}
+
+// Master.h defines FORWARD, STOP etc. as macros, so it comes after Motion.h.
+namespace master {
+#include "Master.h"
+}
+
+#endif
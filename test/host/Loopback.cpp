@@ -0,0 +1,35 @@
+/**
+ *  A master and a slave Communicator connected through the simulated bus, see Loopback.h.
+ */
+
+#include "Loopback.h"
+
+Loopback* Loopback::_active = NULL;
+
+Loopback::Loopback(): slave(ge, motors, slaveWire), master(Wire) {}
+
+Loopback::~Loopback()
+{
+	if(_active == this)
+	{
+		Simulation::reset();
+		_active = NULL;
+	}
+}
+
+void Loopback::begin(uint32_t clock)
+{
+	Simulation::reset();
+	TwoWire::bus = Bus_Model();
+	_active = this;
+
+	slave.begin(ADDRESS);
+	Simulation::start(_loop);
+	master.begin(ADDRESS, clock);
+}
+
+// loop() of the slave sketch
+void Loopback::_loop()
+{
+	_active->slave.executeCommand();
+}
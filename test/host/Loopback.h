@@ -0,0 +1,38 @@
+/**
+ *  A master and a slave Communicator connected through the simulated bus.
+ *
+ *  The slave runs executeCommand() as the second processor of the Simulation,
+ *  the test or benchmark drives the master. Only one Loopback can be active at a time.
+ */
+
+#ifndef Loopback_h
+#define Loopback_h
+
+#include "Communicators.h"
+
+class Loopback
+{
+	public:
+		static const uint8_t ADDRESS = 0x08;
+
+		GraphicEngine ge;
+		Motion motors;
+		TwoWire slaveWire;
+		slave::Communicator slave;
+		master::Communicator master;
+
+		Loopback();
+		~Loopback();
+
+		/** Resets time and the bus, starts the slave and lets the master negotiate the protocol version.
+         *
+         *  @param clock Bus clock in Hz.
+         */
+		void begin(uint32_t clock = 100000);
+
+	private:
+		static Loopback* _active;
+		static void _loop();
+};
+
+#endif
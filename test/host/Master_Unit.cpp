@@ -0,0 +1,11 @@
+/**
+ *  Master Communicator compiled into namespace master, see Communicators.h.
+ */
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "Protocol.h"
+
+namespace master {
+#include "Master.cpp"
+}
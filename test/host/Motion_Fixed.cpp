@@ -0,0 +1,11 @@
+/**
+ *  Motion with Q16.16 arithmetic compiled into namespace fix, see Motions.h.
+ */
+
+#include "Arduino.h"
+#include "Fixed.h"
+
+#define MOTION_FIXED_POINT
+namespace fix {
+#include "Motion.cpp"
+}
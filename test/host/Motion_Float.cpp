@@ -0,0 +1,10 @@
+/**
+ *  Motion with float arithmetic compiled into namespace flt, see Motions.h.
+ */
+
+#include "Arduino.h"
+#include "Fixed.h"
+
+namespace flt {
+#include "Motion.cpp"
+}
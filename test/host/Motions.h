@@ -0,0 +1,26 @@
+/**
+ *  The float and the fixed point build of Motion side by side in one host program.
+ *
+ *  MOTION_FIXED_POINT changes the classes, so each build is compiled inside its
+ *  own namespace, see Motion_Float.cpp and Motion_Fixed.cpp.
+ */
+
+#ifndef Motions_h
+#define Motions_h
+
+// Shared headers first, their include guards keep them out of the namespaces.
+#include "Arduino.h"
+#include "Fixed.h"
+
+namespace flt {
+#include "Motion.h"
+}
+
+#undef MOTION_H
+#define MOTION_FIXED_POINT
+namespace fix {
+#include "Motion.h"
+}
+#undef MOTION_FIXED_POINT
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ *  Simulated time for the host build, see Simulation.h.
+ */
+
+#include "Simulation.h"
+
+#include <ucontext.h>
+
+static const uint32_t STACK_SIZE = 256 * 1024;
+
+static ucontext_t _context[2];
+static uint32_t _clock[2];
+static uint8_t _running = 0;
+static bool _started = false;
+static void (*_loop)() = 0;
+static char _stack[STACK_SIZE];
+
+bool Simulation::_held = false;
+
+// body of the second processor, never returns
+static void _second()
+{
+	for(;;)
+	{
+		_loop();
+		Simulation::advance(1);							// a loop() pass costs at least the call
+	}
+}
+
+static void _switch()
+{
+	uint8_t from = _running;
+	_running = 1 - _running;
+	swapcontext(&_context[from], &_context[_running]);
+}
+
+void Simulation::start(void (*loop)())
+{
+	_loop = loop;
+	_clock[1] = _clock[0];
+	getcontext(&_context[1]);
+	_context[1].uc_stack.ss_sp = _stack;
+	_context[1].uc_stack.ss_size = STACK_SIZE;
+	_context[1].uc_link = 0;
+	makecontext(&_context[1], _second, 0);
+	_started = true;
+}
+
+void Simulation::reset()
+{
+	_started = false;
+	_running = 0;
+	_held = false;
+	_clock[0] = _clock[1] = 0;
+}
+
+void Simulation::advance(uint32_t us)
+{
+	_clock[_running] += us;
+	if(_started && !_held && (int32_t)(_clock[_running] - _clock[1 - _running]) > (int32_t)QUANTUM)
+		_switch();
+}
+
+void Simulation::sync()
+{
+	if(_started && !_held && (int32_t)(_clock[1 - _running] - _clock[_running]) < 0)
+		_switch();
+}
+
+uint32_t Simulation::now()
+{
+	return _clock[_running];
+}
@@ -0,0 +1,46 @@
+/**
+ *  Simulated time for the host build, shared by up to two processors.
+ *
+ *  The main program is the first processor. start() adds a second one that runs
+ *  its loop() forever, e.g. the slave next to a master. Each processor owns a clock
+ *  that advances as it calls micros(), millis(), delay() or transfers on the bus.
+ *  Whenever the running processor gets QUANTUM ahead of the other, the other one
+ *  runs until it is ahead in turn, so both see the same time within QUANTUM.
+ *
+ *  Everything runs on one host thread, a processor only yields while it spends time.
+ */
+
+#ifndef Simulation_h
+#define Simulation_h
+
+#include <stdint.h>
+
+class Simulation
+{
+	public:
+		static const uint32_t QUANTUM = 20;				// us a processor may run ahead of the other.
+
+		/** Starts loop() as the second processor at the time of the first, replaces any previous one. */
+		static void start(void (*loop)());
+
+		/** Removes the second processor and resets both clocks to 0. */
+		static void reset();
+
+		/** Spends us of simulated time on the running processor. */
+		static void advance(uint32_t us);
+
+		/** Lets the other processor catch up with the running one, e.g. before a bus transfer. */
+		static void sync();
+
+		/** Simulated time of the running processor, in us. */
+		static uint32_t now();
+
+		/** Blocks and unblocks switching, like cli() and sei(). Handlers run on behalf of the other processor hold it. */
+		static void hold() { _held = true; }
+		static void release() { _held = false; }
+
+	private:
+		static bool _held;
+};
+
+#endif
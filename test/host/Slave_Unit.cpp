@@ -0,0 +1,13 @@
+/**
+ *  Slave Communicator compiled into namespace slave, see Communicators.h.
+ */
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "Protocol.h"
+#include "Motion.h"
+#include "U8g2_GraphicsEngine.h"
+
+namespace slave {
+#include "Slave.cpp"
+}
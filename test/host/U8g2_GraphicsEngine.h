@@ -0,0 +1,45 @@
+/**
+ *  Host stand-in for the U8g2 GraphicEngine, counts the shapes instead of drawing them.
+ */
+
+#ifndef U8g2_GraphicsEngine_h
+#define U8g2_GraphicsEngine_h
+
+#include "Arduino.h"
+
+class GraphicEngine
+{
+	public:
+		uint16_t shapes;								// Shapes drawn since the last clear().
+		uint16_t texts;									// Strings drawn since the last clear().
+		char lastText[64];
+
+		GraphicEngine(): shapes(0), texts(0) { lastText[0] = '\0'; }
+
+		void begin() { clear(); }
+		int8_t drawPixel(uint8_t, uint8_t) { return _shape(); }
+		int8_t drawLine(uint8_t, uint8_t, uint8_t, uint8_t) { return _shape(); }
+		int8_t drawCircle(uint8_t, uint8_t, uint8_t) { return _shape(); }
+		int8_t drawDisc(uint8_t, uint8_t, uint8_t) { return _shape(); }
+		int8_t drawTriangle(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t) { return _shape(); }
+		int8_t drawRectangle(uint8_t, uint8_t, uint8_t, uint8_t) { return _shape(); }
+		int8_t drawBox(uint8_t, uint8_t, uint8_t, uint8_t) { return _shape(); }
+
+		void drawStr(char* str)
+		{
+			strncpy(lastText, str, sizeof(lastText) - 1);
+			lastText[sizeof(lastText) - 1] = '\0';
+			texts++;
+		}
+
+		void clear()
+		{
+			shapes = 0;
+			texts = 0;
+		}
+
+	private:
+		int8_t _shape() { return shapes++ & 0x7F; }
+};
+
+#endif
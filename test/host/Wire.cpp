@@ -0,0 +1,202 @@
+/**
+ *  Host stand-in for the Wire library, see Wire.h.
+ */
+
+#include "Wire.h"
+
+Bus_Model TwoWire::bus;
+TwoWire* TwoWire::_slaves = NULL;
+
+TwoWire Wire;
+
+// Start, address byte with acknowledge, count data bytes with acknowledge, stop.
+uint32_t Bus_Model::byteTime(uint8_t count) const
+{
+	uint32_t bits = 2 + 9 * (uint32_t)(count + 1);
+	return (bits * 1000000UL + clock - 1) / clock;
+}
+
+TwoWire::TwoWire(): _slave(false), _address(0), _txAddress(0), _txLength(0), _rxLength(0), _rxIndex(0),
+	_onReceive(NULL), _onRequest(NULL), _next(NULL) {}
+
+TwoWire::~TwoWire()
+{
+	end();
+}
+
+void TwoWire::begin()
+{
+	end();
+}
+
+void TwoWire::begin(uint8_t address)
+{
+	end();
+	_slave = true;
+	_address = address;
+	_next = _slaves;
+	_slaves = this;
+}
+
+void TwoWire::end()
+{
+	for(TwoWire** w = &_slaves ; *w ; w = &(*w)->_next)
+		if(*w == this)
+		{
+			*w = _next;
+			break;
+		}
+	_slave = false;
+	_txLength = 0;
+	_rxLength = _rxIndex = 0;
+}
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+	_txAddress = address;
+	_txLength = 0;
+}
+
+// delivers the bytes to every slave at the address, 0 reaching all of them.
+// Returns 2 like the AVR Wire library if no slave acknowledged the address.
+uint8_t TwoWire::endTransmission(uint8_t)
+{
+	uint8_t length = _txLength;
+	_txLength = 0;
+
+	// The other processor keeps running while the bytes are on the bus.
+	Simulation::advance(bus.byteTime(length));
+	Simulation::sync();
+
+	bool acked = false;
+	for(TwoWire* w = _slaves ; w ; w = w->_next)
+	{
+		if(_txAddress != 0 && w->_address != _txAddress) continue;
+		acked = true;
+		bus.transfers++;
+		bus.bytes += length;
+
+		w->_rxLength = 0;
+		w->_rxIndex = 0;
+		for(uint8_t i = 0 ; i < length ; i++)
+		{
+			bool dropped;
+			uint8_t b = _transmit(_tx[i], dropped);
+			if(!dropped) w->_rx[w->_rxLength++] = b;
+		}
+
+		// The receive handler interrupts the slave.
+		if(w->_onReceive)
+		{
+			Simulation::hold();
+			w->_onReceive(w->_rxLength);
+			Simulation::release();
+		}
+	}
+	return acked ? 0 : 2;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity)
+{
+	_rxLength = 0;
+	_rxIndex = 0;
+	if(quantity > BUFFER_LENGTH) quantity = BUFFER_LENGTH;
+
+	Simulation::advance(bus.byteTime(0));
+	Simulation::sync();
+
+	TwoWire* w = _slaves;
+	while(w && w->_address != address)
+		w = w->_next;
+	if(!w || address == 0) return 0;
+
+	// The request handler interrupts the slave and fills its transmit buffer.
+	w->_txLength = 0;
+	if(w->_onRequest)
+	{
+		Simulation::hold();
+		w->_onRequest();
+		Simulation::release();
+	}
+
+	// The master clocks quantity bytes, a slave that sent less leaves the bus high.
+	for(uint8_t i = 0 ; i < quantity ; i++)
+	{
+		bool dropped;
+		uint8_t b = _transmit((i < w->_txLength) ? w->_tx[i] : 0xFF, dropped);
+		_rx[_rxLength++] = dropped ? 0xFF : b;
+	}
+	w->_txLength = 0;
+
+	bus.transfers++;
+	bus.bytes += quantity;
+	Simulation::advance(bus.byteTime(quantity) - bus.byteTime(0));
+	return _rxLength;
+}
+
+size_t TwoWire::write(uint8_t b)
+{
+	if(_txLength >= BUFFER_LENGTH) return 0;
+	_tx[_txLength++] = b;
+	return 1;
+}
+
+size_t TwoWire::write(const uint8_t* data, size_t length)
+{
+	size_t n = 0;
+	while(n < length && write(data[n]))
+		n++;
+	return n;
+}
+
+int TwoWire::available()
+{
+	return _rxLength - _rxIndex;
+}
+
+int TwoWire::read()
+{
+	return (_rxIndex < _rxLength) ? _rx[_rxIndex++] : -1;
+}
+
+int TwoWire::peek()
+{
+	return (_rxIndex < _rxLength) ? _rx[_rxIndex] : -1;
+}
+
+void TwoWire::onReceive(void (*handler)(int))
+{
+	_onReceive = handler;
+}
+
+void TwoWire::onRequest(void (*handler)(void))
+{
+	_onRequest = handler;
+}
+
+// xorshift, independent of random() so faults do not change the master's sequence numbers
+bool TwoWire::_fault(float rate)
+{
+	if(rate <= 0) return false;
+	bus.seed ^= bus.seed << 13;
+	bus.seed ^= bus.seed >> 17;
+	bus.seed ^= bus.seed << 5;
+	return (bus.seed & 0xFFFFFF) < rate * 0x1000000;
+}
+
+// one byte across the bus, possibly lost or with a bit flipped
+uint8_t TwoWire::_transmit(uint8_t b, bool& dropped)
+{
+	dropped = _fault(bus.dropRate);
+	if(dropped)
+	{
+		bus.drops++;
+		return b;
+	}
+	if(_fault(bus.corruptRate))
+	{
+		bus.corruptions++;
+		b ^= 1 << (bus.seed >> 24) % 8;
+	}
+	return b;
+}
@@ -0,0 +1,85 @@
+/**
+ *  Host stand-in for the Wire library: every TwoWire object is attached to one simulated I2C bus.
+ *
+ *  begin() joins the bus as master, begin(address) as slave. A master transfer
+ *  reaches the slave handlers directly, address 0 reaches every slave (general call).
+ *  Transfers take the time the bytes need at the bus clock, and Bus_Model can drop
+ *  or corrupt single bytes on the way.
+ */
+
+#ifndef TwoWire_h
+#define TwoWire_h
+
+#include "Arduino.h"
+
+#define BUFFER_LENGTH 32
+
+/** Timing and fault injection of the simulated bus. */
+struct Bus_Model
+{
+	uint32_t clock;										// Bus clock in Hz, set by the master's setClock().
+	float dropRate;										// Probability that a byte is lost. Lost bytes read as 0xFF.
+	float corruptRate;									// Probability that a byte arrives with one bit flipped.
+	uint32_t seed;										// State of the fault generator, reproducible runs start from the same seed.
+
+	uint32_t transfers;									// Writes and reads addressed to an existing slave.
+	uint32_t bytes;										// Bytes moved by those transfers, without the address byte.
+	uint32_t drops, corruptions;						// Faults injected.
+
+	Bus_Model(): clock(100000), dropRate(0), corruptRate(0), seed(1), transfers(0), bytes(0), drops(0), corruptions(0) {}
+
+	uint32_t byteTime(uint8_t count) const;				// us to move count bytes plus address, start and stop
+};
+
+class TwoWire : public Stream
+{
+	public:
+		static Bus_Model bus;
+
+		TwoWire();
+		~TwoWire();
+
+		void begin();
+		void begin(uint8_t address);
+		void begin(int address) { begin((uint8_t)address); }
+		void end();
+		void setClock(uint32_t clock) { bus.clock = clock; }
+
+		void beginTransmission(uint8_t address);
+		void beginTransmission(int address) { beginTransmission((uint8_t)address); }
+		uint8_t endTransmission(uint8_t sendStop);
+		uint8_t endTransmission() { return endTransmission(true); }
+		uint8_t requestFrom(uint8_t address, uint8_t quantity);
+		uint8_t requestFrom(int address, int quantity) { return requestFrom((uint8_t)address, (uint8_t)quantity); }
+
+		size_t write(uint8_t);
+		size_t write(const uint8_t*, size_t);
+		int available();
+		int read();
+		int peek();
+		using Print::write;
+
+		void onReceive(void (*)(int));
+		void onRequest(void (*)(void));
+
+	private:
+		bool _slave;
+		uint8_t _address;
+		uint8_t _txAddress;
+		uint8_t _tx[BUFFER_LENGTH];
+		uint8_t _txLength;
+		uint8_t _rx[BUFFER_LENGTH];
+		uint8_t _rxLength, _rxIndex;
+		void (*_onReceive)(int);
+		void (*_onRequest)(void);
+
+		TwoWire* _next;									// Next slave on the bus.
+		static TwoWire* _slaves;
+
+		static bool _fault(float rate);
+		static uint8_t _transmit(uint8_t b, bool& dropped);
+};
+
+extern TwoWire Wire;
+
+#endif
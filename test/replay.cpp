@@ -0,0 +1,305 @@
+/**
+ *  Replays a trace of the master into a slave Communicator, see Trace Record Structure in Protocol.h.
+ *
+ *    replay [-a address] [-c clock] trace
+ *        feeds the frames written to address, and the broadcasts, to a slave at the recorded
+ *        times and prints per command type the latency from receipt to completion. The address
+ *        defaults to the one of the first frame, the bus clock in Hz to 100 kHz. The trace does
+ *        not hold the clock, give the one of the master so the frames take their recorded time.
+ *    replay -r trace
+ *        records a short session of the master on the loopback at 400 kHz into trace.
+ *
+ *  The slave runs on the simulated clock with the simulated GraphicEngine and Motion. Frames go
+ *  through the Wire receive handler into recieveCommand(), executeCommand() runs in between like
+ *  loop() of the slave sketch. The host wheels do not turn, so a motion ends only when the trace
+ *  stops it; commands still queued behind it at the end are counted as pending.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <deque>
+
+#include "Bench.h"
+#include "Loopback.h"
+
+typedef master::Command_Packet::Commands Commands;
+
+static const uint16_t DRAIN_TIME = 1000;				// ms the slave keeps running after the last frame.
+
+/** Writes the trace of the master to a file. */
+class File_Print : public Print
+{
+	public:
+		File_Print(FILE* file): _file(file) {}
+		size_t write(uint8_t b) { return fputc(b, _file) == EOF ? 0 : 1; }
+		size_t write(const uint8_t* buffer, size_t size) { return fwrite(buffer, 1, size, _file); }
+
+	private:
+		FILE* _file;
+};
+
+/** Replay results of one command byte. */
+struct Command_Stats
+{
+	uint32_t executed;
+	uint32_t passes;									// executeCommand() passes that executed this command alone,
+	uint64_t cost;										// and the host cost of those passes.
+	Latency_Histogram latency;							// Receipt to completion, in simulated us.
+};
+
+/** A command the slave queued and has not executed yet. */
+struct Queued_Command
+{
+	byte command;
+	uint32_t received;
+};
+
+static Command_Stats commandStats[256];
+static std::deque<Queued_Command> queued;
+
+static const char* commandName(byte command)
+{
+	switch(command)
+	{
+		case Commands::Version:				return "Version";
+		case Commands::DrawPoint:			return "DrawPoint";
+		case Commands::DrawLine:			return "DrawLine";
+		case Commands::DrawCircle:			return "DrawCircle";
+		case Commands::DrawDisc:			return "DrawDisc";
+		case Commands::DrawTriangle:		return "DrawTriangle";
+		case Commands::DrawRectangle:		return "DrawRectangle";
+		case Commands::DrawBox:				return "DrawBox";
+		case Commands::DrawText:			return "DrawText";
+		case Commands::ClearScreen:			return "ClearScreen";
+		case Commands::LeftMotor:			return "LeftMotor";
+		case Commands::RightMotor:			return "RightMotor";
+		case Commands::Move:				return "Move";
+		case Commands::MoveDistance:		return "MoveDistance";
+		case Commands::Stop:				return "Stop";
+		case Commands::TurnAngle:			return "TurnAngle";
+		case Commands::Turn:				return "Turn";
+		case Commands::Drive:				return "Drive";
+		case Commands::MoveMillimeters:		return "MoveMillimeters";
+		case Commands::TurnCentidegrees:	return "TurnCentidegrees";
+		default:							return NULL;
+	}
+}
+
+// remembers the commands of a command or batch frame the slave queued, in queue order
+static void queueCommands(const byte* frame, uint32_t received)
+{
+	switch(frame[0])
+	{
+		case Protocol::COMMAND_START_CODE:
+		case Protocol::COMMAND_START_CODE_V2:
+			queued.push_back({ frame[2], received });
+			break;
+		case Protocol::BATCH_START_CODE:
+		case Protocol::BATCH_START_CODE_V2:
+			for(uint8_t i = 0 ; i < frame[2] ; i++)
+				queued.push_back({ frame[Protocol::BATCH_HEADER_SIZE + i*Protocol::BATCH_ENTRY_SIZE], received });
+			break;
+	}
+}
+
+// writes the frame to the bus, the receive handler of the slave parses it right away
+static void deliver(slave::Communicator& s, uint8_t address, const byte* frame, uint8_t length)
+{
+	slave::Link_Stats before = s.stats();
+	Wire.beginTransmission(address);
+	Wire.write(frame, length);
+	Wire.endTransmission();
+	slave::Link_Stats after = s.stats();
+
+	// Corrupt frames, retransmissions and overflows never reach the queue.
+	if(after.framesReceived != before.framesReceived && after.retransmissions == before.retransmissions
+		&& after.overflows == before.overflows)
+		queueCommands(frame, micros());
+}
+
+// one pass of loop() of the slave, charged to the commands it executed
+static void step(slave::Communicator& s)
+{
+	uint16_t executed = s.stats().commandsExecuted;
+	uint64_t start = counter();
+	s.executeCommand();
+	uint64_t cost = counter() - start;
+	uint16_t count = s.stats().commandsExecuted - executed;
+	uint32_t now = micros();
+
+	for(uint16_t i = 0 ; i < count && !queued.empty() ; i++)
+	{
+		Command_Stats& cs = commandStats[queued.front().command];
+		cs.executed++;
+		cs.latency.add(now - queued.front().received);
+		if(count == 1)
+		{
+			cs.passes++;
+			cs.cost += cost;
+		}
+		queued.pop_front();
+	}
+}
+
+static void report(uint32_t records, uint32_t replayed, uint8_t address)
+{
+	printf("%u trace records, %u replayed to address 0x%02X, %u commands still pending\n",
+		(unsigned)records, (unsigned)replayed, address, (unsigned)queued.size());
+	for(uint16_t c = 0 ; c < 256 ; c++)
+	{
+		const Command_Stats& cs = commandStats[c];
+		if(!cs.executed) continue;
+
+		const char* name = commandName(c);
+		if(name) printf("%s", name);
+		else printf("0x%02X", c);
+		printf(": %u executed", (unsigned)cs.executed);
+		if(cs.passes)
+			printf(", %.0f host %s per pass", (double)cs.cost / cs.passes, COUNTER_UNIT);
+		printf("\nlatency us\tcount\n");
+		cs.latency.print(Serial);
+	}
+}
+
+static int replay(const char* path, int address, uint32_t clock)
+{
+	FILE* file = fopen(path, "rb");
+	if(!file)
+	{
+		perror(path);
+		return 1;
+	}
+
+	Simulation::reset();
+	GraphicEngine ge;
+	Motion motors;
+	TwoWire slaveWire;
+	slave::Communicator s(ge, motors, slaveWire);
+	Wire.begin();
+	Wire.setClock(clock);
+
+	byte header[Protocol::TRACE_HEADER_SIZE];
+	byte frame[256];
+	bool begun = false;
+	uint32_t first = 0, start = 0, records = 0, replayed = 0;
+	while(fread(header, 1, Protocol::TRACE_HEADER_SIZE, file) == Protocol::TRACE_HEADER_SIZE)
+	{
+		uint8_t length = header[5];
+		if(fread(frame, 1, length, file) != length || length == 0 || length > WIRE_BUFFER_LENGTH)
+		{
+			fprintf(stderr, "%s: corrupt trace record %u\n", path, (unsigned)records);
+			fclose(file);
+			return 1;
+		}
+		records++;
+
+		uint8_t to = header[4];
+		if(address < 0 && to != 0) address = to;
+		if(address < 0 || (to != 0 && to != address)) continue;
+
+		uint32_t time = Protocol::readInt32(header);
+		if(!begun)
+		{
+			s.begin(address);
+			first = time;
+			start = micros();
+			begun = true;
+		}
+		uint32_t due = start + (time - first);
+		while((int32_t)(due - micros()) > 0)
+			step(s);
+		deliver(s, to, frame, length);
+		replayed++;
+	}
+	fclose(file);
+
+	if(!begun)
+	{
+		fprintf(stderr, "%s: no frames to replay\n", path);
+		return 1;
+	}
+	uint32_t end = millis();
+	while(millis() - end < DRAIN_TIME)
+		step(s);
+
+	report(records, replayed, address);
+	printf("slave ");
+	s.printStats(Serial);
+	return 0;
+}
+
+// polls the last command for at most ms, like a sketch polling from loop()
+static void settle(master::Communicator& m, uint32_t ms)
+{
+	uint32_t start = millis();
+	while(m.pollResponse() == master::Communicator::Poll_Result::Pending && millis() - start < ms)
+		delay(1);
+}
+
+static int record(const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if(!file)
+	{
+		perror(path);
+		return 1;
+	}
+	File_Print trace(file);
+
+	static Loopback link;
+	link.begin(400000);
+	link.master.setFlowControl(true);
+	link.master.setTrace(&trace);
+
+	link.master.clearScreen();
+	for(uint8_t i = 0 ; i < 16 ; i++)
+		link.master.drawLine(8*i, 0, 127 - 8*i, 63);
+	link.master.drawText((char*)"replayed from a trace");
+	link.master.BeginBatch();
+	link.master.drawBox(10, 10, 20, 20);
+	link.master.drawCircle(64, 32, 16);
+	link.master.drawPoint(100, 50);
+	link.master.EndBatch();
+
+	// The wheels do not turn on the host, the session stops each motion itself.
+	link.master.moveMillimeters(200, 100);
+	settle(link.master, 300);
+	link.master.drawDisc(64, 32, 8);
+	link.master.stop();
+	link.master.turnCentidegrees(9000, 45);
+	settle(link.master, 200);
+	link.master.stop();
+	link.master.drawTriangle(0, 63, 64, 0, 127, 63);
+	settle(link.master, 100);
+
+	link.master.setTrace(NULL);
+	fclose(file);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int address = -1;
+	uint32_t clock = 100000;
+	const char* recording = NULL;
+	int option;
+	while((option = getopt(argc, argv, "a:c:r:")) != -1)
+	{
+		switch(option)
+		{
+			case 'a': address = strtol(optarg, NULL, 0); break;
+			case 'c': clock = strtoul(optarg, NULL, 0); break;
+			case 'r': recording = optarg; break;
+			default: optind = argc + 1; break;
+		}
+	}
+
+	if(recording && optind == argc)
+		return record(recording);
+	if(!recording && optind == argc - 1 && clock > 0 && address >= -1 && address <= 0x7F)
+		return replay(argv[optind], address, clock);
+
+	fprintf(stderr, "usage: %s [-a address] [-c clock] trace\n       %s -r trace\n", argv[0], argv[0]);
+	return 2;
+}
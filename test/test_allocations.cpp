@@ -0,0 +1,124 @@
+/**
+ *  The command path does not touch the heap, neither on the master nor on the slave.
+ *
+ *  Replaces the global operator new and delete with counting ones, then sends every
+ *  command method of the master through the loopback and lets the slave decode,
+ *  queue and execute them. Allocations made by begin() are outside the count.
+ */
+
+#include <new>
+#include <stdlib.h>
+
+#include "Loopback.h"
+#include "Check.h"
+
+static unsigned long allocations = 0, releases = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	void* p = malloc(size ? size : 1);
+	if(!p) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	if(!p) return;
+	releases++;
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+typedef master::Command_Packet::Commands Commands;
+
+static void sendEveryCommand(master::Communicator& m)
+{
+	m.drawPoint(3, 4);
+	m.drawLine(1, 2, 127, 63);
+	m.drawCircle(64, 32, 20);
+	m.drawDisc(10, 11, 5);
+	m.drawTriangle(1, 2, 3, 4, 5, 6);
+	m.drawRectangle(7, 8, 9, 10);
+	m.drawBox(11, 12, 13, 14);
+	m.drawText((char*)"no heap");
+	m.clearScreen();
+	m.leftMotor(1, 180);
+	m.rightMotor(0, 90);
+	m.move(1, 100);
+	m.turn(120, 0);
+	m.stop();
+	m.moveDistance(30, 0, 5);
+	m.stop();
+	m.moveMillimeters(-1234, 150);
+	m.stop();
+	m.turnAngle(90, 1, 30);
+	m.stop();
+	m.turnCentidegrees(9050, 45);
+	m.stop();
+}
+
+static void testBlockingApi(bool flowControl)
+{
+	static Loopback link;
+	link.begin();
+	link.master.setFlowControl(flowControl);
+
+	unsigned long allocated = allocations, released = releases;
+	sendEveryCommand(link.master);
+	delay(50);											// The slave executes the last command.
+	CHECK_EQUAL(allocated, allocations);
+	CHECK_EQUAL(released, releases);
+	CHECK_EQUAL(0, link.slave.stats().commandErrors);
+	CHECK(link.slave.stats().framesReceived >= 23);
+}
+
+static void testBatchAndSubmit()
+{
+	static Loopback link;
+	link.begin();
+	link.master.setFlowControl(true);
+
+	unsigned long allocated = allocations, released = releases;
+	link.master.BeginBatch();
+	link.master.drawLine(0, 0, 127, 63);
+	link.master.drawBox(10, 10, 8, 8);
+	link.master.drawPoint(5, 5);
+	link.master.EndBatch();
+
+	master::Command_Handle h = link.master.submit(Commands::DrawCircle, 64, 32, 20);
+	CHECK(h.valid);
+	while(link.master.status(h) == master::Communicator::Poll_Result::Pending)
+		link.master.poll();
+
+	CHECK_EQUAL(allocated, allocations);
+	CHECK_EQUAL(released, releases);
+	CHECK_EQUAL(4, link.ge.shapes);
+}
+
+int main()
+{
+	testBlockingApi(false);
+	testBlockingApi(true);
+	testBatchAndSubmit();
+	return checkReport("test_allocations");
+}
@@ -0,0 +1,217 @@
+/**
+ *  Unit tests of the slave's Command_Queue, and of how the slave fills it.
+ */
+
+#include "Loopback.h"
+#include "Check.h"
+
+using slave::Command_Packet;
+using slave::Command_Queue;
+
+static const uint8_t CAPACITY = COMMAND_QUEUE_DEPTH - 1;
+
+static Command_Packet packet(byte id, byte command = Protocol::Commands::DrawLine)
+{
+	byte entry[Protocol::BATCH_ENTRY_SIZE] = { command, id, (byte)(id + 1), (byte)(id + 2), 0, 0, (byte)~id };
+	return Command_Packet(id, entry);
+}
+
+static bool matches(const Command_Packet& cp, byte id)
+{
+	return cp.id == id && cp.Parameter[0] == id && cp.Parameter[1] == (byte)(id + 1)
+	    && cp.Parameter[2] == (byte)(id + 2) && cp.Parameter[5] == (byte)~id;
+}
+
+static void testOrder()
+{
+	Command_Queue queue;
+	Command_Packet cp;
+	CHECK(queue.empty());
+	CHECK(!queue.pop(cp));
+
+	for(byte id = 1 ; id <= 5 ; id++)
+		CHECK(queue.push(packet(id)));
+	for(byte id = 1 ; id <= 5 ; id++)
+	{
+		CHECK(queue.pop(cp));
+		CHECK(matches(cp, id));
+	}
+	CHECK(queue.empty());
+	CHECK_EQUAL(0, queue.overflows());
+}
+
+static void testWrapAround()
+{
+	Command_Queue queue;
+	Command_Packet cp;
+	byte pushed = 0, popped = 0;
+
+	// 3 in, 3 out moves the indices around the ring many times.
+	for(uint16_t round = 0 ; round < 200 ; round++)
+	{
+		for(uint8_t i = 0 ; i < 3 ; i++)
+			CHECK(queue.push(packet(pushed++)));
+		for(uint8_t i = 0 ; i < 3 ; i++)
+		{
+			CHECK(queue.pop(cp));
+			CHECK(matches(cp, popped++));
+		}
+	}
+	CHECK(queue.empty());
+}
+
+static void testOverflow()
+{
+	Command_Queue queue;
+	Command_Packet cp;
+
+	for(byte id = 0 ; id < CAPACITY ; id++)
+		CHECK(queue.push(packet(id)));
+	CHECK(!queue.push(packet(0xEE)));
+	CHECK_EQUAL(1, queue.overflows());
+
+	// fits() counts every command of a frame that is turned away.
+	CHECK(!queue.fits(3));
+	CHECK_EQUAL(4, queue.overflows());
+
+	CHECK(queue.pop(cp));
+	CHECK(matches(cp, 0));
+	CHECK(queue.fits(1));
+	CHECK(!queue.fits(2));
+	CHECK(queue.push(packet(CAPACITY)));
+
+	// The dropped command never shows up.
+	for(byte id = 1 ; id <= CAPACITY ; id++)
+	{
+		CHECK(queue.pop(cp));
+		CHECK(matches(cp, id));
+	}
+	CHECK(queue.empty());
+	CHECK_EQUAL(6, queue.overflows());
+	CHECK(queue.fits(CAPACITY));
+	CHECK(!queue.fits(CAPACITY + 1));
+	CHECK_EQUAL(6 + CAPACITY + 1, queue.overflows());
+}
+
+static void testPeek()
+{
+	Command_Queue queue;
+	Command_Packet cp;
+	CHECK(!queue.peek(cp));
+
+	for(byte id = 10 ; id < 13 ; id++)
+		queue.push(packet(id));
+	CHECK(queue.peek(cp));
+	CHECK(matches(cp, 10));
+	CHECK(queue.peek(cp, 2));
+	CHECK(matches(cp, 12));
+	CHECK(!queue.peek(cp, 3));
+
+	// peek() does not consume.
+	CHECK(queue.pop(cp));
+	CHECK(matches(cp, 10));
+}
+
+// The receive handler and executeCommand() interleave in any order.
+// Whatever push() accepted comes out of pop() once, in order, with its receive time.
+static void testInterleaving()
+{
+	Command_Queue queue;
+	Command_Packet cp;
+	uint32_t seed = 12345;
+	byte next = 0, expected = 0;
+	uint16_t dropped = 0;
+	uint32_t lastReceived = 0;
+
+	for(uint16_t step = 0 ; step < 5000 ; step++)
+	{
+		seed = seed * 1103515245 + 12345;
+		// Bursts on either side, so the ring runs both full and empty.
+		bool produce = ((seed >> 16) % 100) < ((step / 500) % 2 ? 70 : 30);
+		if(produce)
+		{
+			if(queue.push(packet(next)))
+				next++;
+			else
+				dropped++;
+		}
+		else
+		{
+			uint32_t received;
+			if(queue.pop(cp, &received))
+			{
+				CHECK(matches(cp, expected));
+				CHECK(received >= lastReceived);
+				lastReceived = received;
+				expected++;
+			}
+		}
+	}
+	while(queue.pop(cp))
+		CHECK(matches(cp, expected++));
+
+	CHECK(dropped > 0);
+	CHECK_EQUAL(dropped, queue.overflows());
+	CHECK_EQUAL(next, expected);
+}
+
+// writes a raw frame to the slave like the master's Wire would
+static void transfer(const byte* frame, uint8_t length)
+{
+	Wire.beginTransmission(Loopback::ADDRESS);
+	Wire.write(frame, length);
+	Wire.endTransmission();
+}
+
+static void sendBatch(byte id, uint8_t count)
+{
+	byte frame[WIRE_BUFFER_LENGTH] = { Protocol::BATCH_START_CODE_V2, id, count };
+	uint8_t length = Protocol::BATCH_HEADER_SIZE;
+	for(uint8_t i = 0 ; i < count ; i++, length += Protocol::BATCH_ENTRY_SIZE)
+	{
+		frame[length] = Protocol::Commands::DrawPoint;
+		frame[length + 1] = i;
+		frame[length + 2] = id;
+	}
+	frame[length] = Protocol::crc8(&frame[1], length - 1);
+	transfer(frame, length + 1);
+}
+
+// A batch that does not fit is turned away as a whole, and its retransmission is accepted later.
+static void testSlaveRejectsWholeBatch()
+{
+	static Loopback link;
+	Simulation::reset();
+	TwoWire::bus = Bus_Model();
+	link.slave.begin(Loopback::ADDRESS);				// No loop(), the queue only fills.
+	Wire.begin();
+
+	sendBatch(1, 4);
+	CHECK_EQUAL(0, link.slave.overflows());
+	sendBatch(2, 4);									// 4 of the 7 slots are taken.
+	CHECK_EQUAL(4, link.slave.overflows());
+
+	link.slave.executeCommand();
+	CHECK_EQUAL(4, link.ge.shapes);
+
+	sendBatch(2, 4);									// The master retries, the id was not recorded.
+	link.slave.executeCommand();
+	CHECK_EQUAL(8, link.ge.shapes);
+	CHECK_EQUAL(0, link.slave.stats().retransmissions);
+
+	sendBatch(2, 4);									// A real repetition is dropped.
+	link.slave.executeCommand();
+	CHECK_EQUAL(8, link.ge.shapes);
+	CHECK_EQUAL(1, link.slave.stats().retransmissions);
+}
+
+int main()
+{
+	testOrder();
+	testWrapAround();
+	testOverflow();
+	testPeek();
+	testInterleaving();
+	testSlaveRejectsWholeBatch();
+	return checkReport("test_command_queue");
+}
@@ -0,0 +1,222 @@
+/**
+ *  Agreement of the fixed point build of Motion with the float build.
+ *
+ *  Both builds get the same inputs: the PID controllers with the gains Motion::begin()
+ *  uses, the omega estimator with the same encoder ticks, and the distance to tick
+ *  conversions of whole moves and turns.
+ */
+
+#include "Motions.h"
+#include "Check.h"
+
+static const double TICKS_PER_M = 960 / (2 * PI * 0.0318);
+
+template <class Pid_T> static void velocityGains(Pid_T& pid)
+{
+	pid.kp = 200;
+	pid.ki = 1500;
+	pid.kaw = 7.5;
+	pid.ITERM_LIMIT = 90;
+	pid.RETURN_LIMIT = 250;
+}
+
+template <class Pid_T> static void positionGains(Pid_T& pid)
+{
+	pid.kp = 0.02;
+	pid.ki = 0.2;
+	pid.kaw = 10;
+	pid.ITERM_LIMIT = 0.4;
+	pid.kff = 1;
+	pid.RETURN_LIMIT = 4;
+}
+
+// A wheel that follows a reference badly, so the output runs into the limits and back.
+static void testVelocityPid()
+{
+	flt::Pid pf;
+	fix::Pid px;
+	velocityGains(pf);
+	velocityGains(px);
+
+	double worst = 0;
+	for(uint16_t k = 0 ; k < 5000 ; k++)
+	{
+		float ref = 8 * sin(k * 0.004);
+		float meas = 7 * sin(k * 0.004 - 0.3) + 0.05 * (k % 7);
+		float of = pf.getVal(ref - meas, meas, 0.002f, ref);
+		float ox = (float)px.getVal(fix::motion_t(ref - meas), fix::motion_t(meas), fix::motion_t(0.002f), fix::motion_t(ref));
+		worst = fmax(worst, fabs(of - ox));
+		CHECK_CLOSE(of, ox, 0.5);
+	}
+	printf("velocity pid: worst difference %.4f pwm\n", worst);
+}
+
+// Tracking errors in ticks with the profile's omega as feed-forward.
+static void testPositionPid()
+{
+	flt::Pid pf;
+	fix::Pid px;
+	positionGains(pf);
+	positionGains(px);
+
+	double worst = 0;
+	for(uint16_t k = 0 ; k < 5000 ; k++)
+	{
+		long err = (long)(40 * sin(k * 0.01)) + (k % 5) - 2;
+		float ff = 3 * sin(k * 0.002);
+		float of = pf.getVal(err, -err, 0.002f, ff);
+		float ox = (float)px.getVal(err, -err, fix::motion_t(0.002f), fix::motion_t(ff));
+		worst = fmax(worst, fabs(of - ox));
+		CHECK_CLOSE(of, ox, 0.01);
+	}
+	printf("position pid: worst difference %.5f rad/s\n", worst);
+}
+
+// Both wheels see each tick, the second one 1 us later than the first.
+static void testOmega()
+{
+	Simulation::reset();
+	flt::Wheel wf(2, 16);
+	fix::Wheel wx(2, 16);
+	const uint32_t intervals[] = { 40, 100, 500, 2000, 10000, 50000 };
+
+	for(uint8_t i = 0 ; i < sizeof(intervals) / sizeof(intervals[0]) ; i++)
+	{
+		for(uint8_t t = 0 ; t < 12 ; t++)
+		{
+			Simulation::advance(intervals[i]);
+			wf.encUpdate();
+			wx.encUpdate();
+		}
+		// The host reads the sign pin LOW, the wheel turns backwards.
+		double expected = -2 * PI / 960 / ((intervals[i] + 2) * 1e-6);
+		float of = wf.getOmega();
+		float ox = (float)wx.getOmega();
+		CHECK_CLOSE(expected, of, fabs(expected) * 0.01);
+		CHECK_CLOSE(of, ox, fabs(expected) * 0.002 + 0.001);
+	}
+
+	// Without ticks omega decays, then drops to 0 at the timeout.
+	for(uint8_t step = 0 ; step < 30 ; step++)
+	{
+		Simulation::advance(10000);
+		float of = wf.getOmega();
+		float ox = (float)wx.getOmega();
+		CHECK_CLOSE(of, ox, fabs(of) * 0.002 + 0.001);
+	}
+	CHECK_EQUAL(0, wf.getOmega());
+	CHECK(wx.getOmega() == fix::motion_t(0));
+}
+
+// Runs both Motions tick by tick, the wheels stand still, and compares the position references.
+// Q16.16 resolves dt to 15 us, so on the way the fixed profile may lag by 0.2% of the distance.
+template <class Start> static void compareMoves(Start start, uint32_t ticks, long expectedL, long expectedR, long tolerance)
+{
+	Simulation::reset();
+	static flt::Motion mf;
+	static fix::Motion mx;
+	mf.begin();
+	mx.begin();
+	start(mf, mx);
+
+	long worst = 0;
+	for(uint32_t t = 0 ; t < ticks ; t++)
+	{
+		Simulation::advance(2000);
+		mf.updt();
+		mx.updt();
+		long diff = abs(mf.getPosRefL() - mx.getPosRefL());
+		if(diff > worst) worst = diff;
+		CHECK(diff <= tolerance);
+	}
+	printf("move to %ld ticks: worst difference on the way %ld ticks\n", expectedL, worst);
+	CHECK_CLOSE(expectedL, mf.getPosRefL(), 1);
+	CHECK_CLOSE(expectedL, mx.getPosRefL(), 1);
+	CHECK_CLOSE(expectedR, mf.getPosRefR(), 1);
+	CHECK_CLOSE(expectedR, mx.getPosRefR(), 1);
+}
+
+static void move1000(flt::Motion& mf, fix::Motion& mx)
+{
+	mf.move_to_mm(1000, 80);
+	mx.move_to_mm(1000, 80);
+}
+
+static void quarterTurn(flt::Motion& mf, fix::Motion& mx)
+{
+	mf.rotate_to_cdeg(-9000);
+	mx.rotate_to_cdeg(-9000);
+}
+
+// 10 m are about 48000 ticks, beyond the range of a Q16.16 number.
+static void move10m(flt::Motion& mf, fix::Motion& mx)
+{
+	mf.set_profile(1, 1, 0);
+	mx.set_profile(1, 1, 0);
+	mf.move_to_mm(10000);
+	mx.move_to_mm(10000);
+}
+
+static void testConversions()
+{
+	long quarter = lround(-0.135 * PI / 2 * TICKS_PER_M);
+	compareMoves(move1000, 7000, lround(TICKS_PER_M), lround(TICKS_PER_M), 10);
+	compareMoves(quarterTurn, 2500, quarter, -quarter, 5);
+	compareMoves(move10m, 6500, lround(10 * TICKS_PER_M), lround(10 * TICKS_PER_M), 100);
+}
+
+// Both builds refuse moves and turns beyond MAX_DISTANCE_MM, the longest ones keep their direction.
+template <class Motion_T> static void checkRanges()
+{
+	Simulation::reset();
+	static Motion_T m;
+	m.begin();
+
+	CHECK(!m.move_to_mm(Motion_T::MAX_DISTANCE_MM + 1));
+	CHECK(!m.move_to_mm(-40000));
+	CHECK(!m.move_to(33.0));
+	CHECK(!m.rotate_to_cdeg(2000000));
+	CHECK_EQUAL(0, m.getMode());
+
+	CHECK(m.move_to_mm(-Motion_T::MAX_DISTANCE_MM, 65535));
+	for(uint8_t t = 0 ; t < 50 ; t++)
+	{
+		Simulation::advance(2000);
+		m.updt();
+	}
+	CHECK(m.getPosRefL() < 0);
+	CHECK(m.getPosRefR() < 0);
+
+	CHECK(m.rotate_to_cdeg(1300000, 65535));
+	for(uint8_t t = 0 ; t < 50 ; t++)
+	{
+		Simulation::advance(2000);
+		m.updt();
+	}
+	CHECK(m.getPosRefL() > 0);
+	CHECK(m.getPosRefR() < 0);
+	m.stop();
+}
+
+static void testRanges()
+{
+	checkRanges<flt::Motion>();
+	checkRanges<fix::Motion>();
+
+	// Fewer encoder ticks per turn leave omega_scale beyond the Q16.16 range.
+	fix::Wheel fixed(2, 16);
+	CHECK(!fixed.set_encoder_count(fix::Wheel::MIN_ENC_COUNT - 1));
+	CHECK_EQUAL(fix::Wheel::DEFAULT_ENC_COUNT, fixed.ENC_COUNT);
+	CHECK(fixed.set_encoder_count(fix::Wheel::MIN_ENC_COUNT));
+	CHECK(flt::Wheel(2, 16).set_encoder_count(100));
+}
+
+int main()
+{
+	testVelocityPid();
+	testPositionPid();
+	testOmega();
+	testConversions();
+	testRanges();
+	return checkReport("test_fixed_point");
+}
@@ -0,0 +1,223 @@
+/**
+ *  End-to-end tests of the master and slave Communicator over the simulated bus.
+ */
+
+#include "Loopback.h"
+#include "Check.h"
+
+typedef master::Communicator::Poll_Result Poll_Result;
+typedef master::Command_Packet::Commands Commands;
+
+static Loopback link;
+
+// waits for the final result of the last command, like a sketch polling from loop()
+static Poll_Result::Poll_Result_Enum finish()
+{
+	Poll_Result::Poll_Result_Enum result;
+	while((result = link.master.pollResponse()) == Poll_Result::Pending)
+		delay(1);
+	return result;
+}
+
+// polls like finish() for at most ms, Pending if the command is still running then
+static Poll_Result::Poll_Result_Enum finishWithin(uint32_t ms)
+{
+	Poll_Result::Poll_Result_Enum result;
+	uint32_t start = millis();
+	while((result = link.master.pollResponse()) == Poll_Result::Pending && millis() - start < ms)
+		delay(1);
+	return result;
+}
+
+static void testNegotiation()
+{
+	link.begin();
+	CHECK_EQUAL(2, link.master.protocolVersion());
+	CHECK_EQUAL(0, link.slave.corruptFrames());
+}
+
+// A slave that boots after the master is driven with version 1 until negotiate() runs.
+static void testLateSlave()
+{
+	link.begin();
+	link.slaveWire.end();
+	link.master.begin(Loopback::ADDRESS, 400000);
+	CHECK_EQUAL(1, link.master.protocolVersion());
+
+	link.slave.begin(Loopback::ADDRESS);
+	CHECK_EQUAL(2, link.master.negotiate());
+	link.master.setFlowControl(true);
+	link.master.drawPoint(1, 2);
+	CHECK_EQUAL(Poll_Result::Ok, finish());
+	Telemetry_Packet telemetry;
+	CHECK(link.master.readTelemetry(telemetry));
+	CHECK_EQUAL(1, link.ge.shapes);
+}
+
+static void testCommands()
+{
+	link.begin(400000);
+	link.master.setFlowControl(true);
+
+	link.master.drawLine(0, 0, 10, 10);
+	link.master.drawCircle(20, 20, 5);
+	link.master.drawPoint(3, 4);
+	CHECK_EQUAL(Poll_Result::Ok, finish());
+	CHECK_EQUAL(3, link.ge.shapes);
+
+	link.master.drawText((char*)"hello, simulated bus");
+	CHECK_EQUAL(Poll_Result::Ok, finish());
+	CHECK(strcmp(link.ge.lastText, "hello, simulated bus") == 0);
+
+	// So are moves beyond the range of Motion.
+	link.master.moveMillimeters(40000);
+	CHECK_EQUAL(Poll_Result::Error, finish());
+	CHECK_EQUAL(0, link.motors.getMode());
+
+	// Unknown command bytes are answered with ERROR.
+	link.master.sendCommand(master::Command_Packet(0x42, (Commands::Commands_Enum)0x2F));
+	CHECK_EQUAL(Poll_Result::Error, finish());
+}
+
+static void testSubmit()
+{
+	link.begin(400000);
+	link.master.setFlowControl(true);
+
+	master::Command_Handle handles[5];
+	for(uint8_t i = 0 ; i < 5 ; i++)
+	{
+		handles[i] = link.master.submit(Commands::DrawBox, i, i, 4, 4);
+		CHECK(handles[i].valid);
+	}
+	while(!link.master.idle())
+		link.master.poll();
+
+	for(uint8_t i = 0 ; i < 5 ; i++)
+		CHECK_EQUAL(Poll_Result::Ok, link.master.status(handles[i]));
+	CHECK_EQUAL(5, link.ge.shapes);
+
+	// Without its Text Packets DrawText would draw stale text.
+	master::Command_Handle text = link.master.submit(Commands::DrawText);
+	CHECK(!text.valid);
+	CHECK_EQUAL(Poll_Result::Error, link.master.status(text));
+	CHECK(link.master.idle());
+}
+
+// A move the slave acknowledged stays Pending while it runs, however long that takes.
+// The host wheels do not turn, so the test ends the move itself well past the response timeout.
+static void testLongMove()
+{
+	const uint32_t RUNNING = 2000;
+
+	link.begin(400000);
+	link.master.setFlowControl(true);
+
+	uint32_t start = millis();
+	link.master.moveMillimeters(300, 100);
+	while(millis() - start < RUNNING)
+	{
+		CHECK(link.master.pollResponse() == Poll_Result::Pending);
+		delay(10);
+	}
+	CHECK_EQUAL(1, link.motors.getMode());
+	link.motors.stop();
+	CHECK_EQUAL(Poll_Result::Ok, finish());
+
+	byte p[Protocol::PARAMETER_COUNT];
+	Protocol::writeInt32(p, -300);
+	Protocol::writeInt16(&p[4], 100);
+	start = millis();
+	master::Command_Handle handle = link.master.submit(Commands::MoveMillimeters, p[0], p[1], p[2], p[3], p[4], p[5]);
+	while(millis() - start < RUNNING)
+	{
+		link.master.poll();
+		CHECK(link.master.status(handle) == Poll_Result::Pending);
+		delay(10);
+	}
+	link.motors.stop();
+	while(link.master.status(handle) == Poll_Result::Pending)
+	{
+		link.master.poll();
+		delay(1);
+	}
+	CHECK_EQUAL(Poll_Result::Ok, link.master.status(handle));
+	CHECK_EQUAL(0, link.master.stats().timeouts);
+}
+
+// An emergency stop is never dropped as a retransmission, not after a lost frame and not twice in a row.
+static void testBroadcastStop()
+{
+	link.begin(400000);
+
+	for(uint8_t i = 0 ; i < 2 ; i++)
+	{
+		link.master.moveMillimeters(500, 100);
+		CHECK_EQUAL(Poll_Result::Pending, finishWithin(5));
+		CHECK_EQUAL(1, link.motors.getMode());
+
+		// The slave misses the master's last frame.
+		TwoWire::bus.dropRate = 1;
+		link.master.drawPoint(1, 1);
+		TwoWire::bus.dropRate = 0;
+
+		master::Communicator::broadcastStop(Wire);
+		CHECK_EQUAL(Poll_Result::Ok, finish());
+		CHECK_EQUAL(0, link.motors.getMode());
+	}
+	CHECK_EQUAL(0, link.slave.stats().retransmissions);
+	CHECK_EQUAL(0, link.ge.shapes);
+}
+
+// DRAW_TEXT waiting for its text does not hold up the running motion, and fails once the text timed out.
+static void testTextWait()
+{
+	link.begin(400000);
+	link.master.setResponseTimeout(2000000);
+
+	link.master.moveMillimeters(500, 100);
+	CHECK_EQUAL(Poll_Result::Pending, finishWithin(5));
+	link.master.sendCommand(master::Command_Packet(0x43, Commands::DrawText));
+	uint32_t ticks = link.motors.getTickStats().ticks;
+	CHECK_EQUAL(Poll_Result::Pending, finishWithin(300));
+	CHECK(link.motors.getTickStats().ticks > ticks + 50);
+	CHECK_EQUAL(Poll_Result::Error, finish());
+	CHECK_EQUAL(0, link.ge.texts);
+	link.master.stop();
+}
+
+// Every command is executed at most once, and all of them get through unless the retries run out.
+static void testFaults()
+{
+	const uint8_t COMMANDS = 100;
+
+	link.begin(100000);
+	link.master.setFlowControl(true);
+	link.master.setReliable(true, 5);
+	TwoWire::bus.dropRate = 0.002;
+	TwoWire::bus.corruptRate = 0.005;
+
+	for(uint8_t i = 0 ; i < COMMANDS ; i++)
+		link.master.drawLine(i, 0, i, 63);
+	finish();
+
+	const master::Link_Stats& stats = link.master.stats();
+	CHECK(TwoWire::bus.drops + TwoWire::bus.corruptions > 0);
+	CHECK(stats.retries > 0);
+	CHECK(link.ge.shapes <= COMMANDS);
+	CHECK(link.ge.shapes + stats.timeouts >= COMMANDS);
+	CHECK(link.slave.stats().retransmissions > 0 || link.slave.corruptFrames() > 0);
+}
+
+int main()
+{
+	testNegotiation();
+	testLateSlave();
+	testCommands();
+	testSubmit();
+	testLongMove();
+	testBroadcastStop();
+	testTextWait();
+	testFaults();
+	return checkReport("test_loopback");
+}
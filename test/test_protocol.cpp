@@ -0,0 +1,233 @@
+/**
+ *  Round trips through the shared packet layouts: what one side encodes the other side decodes.
+ *
+ *  Every command method of the master is traced on the way to the slave and decoded with
+ *  the slave's Command_Packet, responses go from the slave's to the master's Response_Packet
+ *  and telemetry through the shared Telemetry_Packet.
+ */
+
+#include <vector>
+
+#include "Loopback.h"
+#include "Check.h"
+
+typedef master::Command_Packet::Commands Commands;
+
+/** Collects the trace records of the master, see Trace Record Structure. */
+class Trace_Buffer : public Print
+{
+	public:
+		std::vector<byte> bytes;
+
+		size_t write(uint8_t b) { bytes.push_back(b); return 1; }
+
+		/** Frames recorded from offset on. */
+		std::vector<std::vector<byte> > frames(size_t offset) const
+		{
+			std::vector<std::vector<byte> > out;
+			while(offset + Protocol::TRACE_HEADER_SIZE <= bytes.size())
+			{
+				uint8_t length = bytes[offset + 5];
+				offset += Protocol::TRACE_HEADER_SIZE;
+				out.push_back(std::vector<byte>(bytes.begin() + offset, bytes.begin() + offset + length));
+				offset += length;
+			}
+			return out;
+		}
+};
+
+static bool decodes(const std::vector<byte>& frame, Commands::Commands_Enum command,
+	byte p0 = 0, byte p1 = 0, byte p2 = 0, byte p3 = 0, byte p4 = 0, byte p5 = 0)
+{
+	if(frame.size() != Protocol::COMMAND_LENGTH) return false;
+	slave::Command_Packet cp((byte*)&frame[0], false);
+	const byte p[] = { p0, p1, p2, p3, p4, p5 };
+	return cp.valid && cp._command == command && memcmp(cp.Parameter, p, sizeof(p)) == 0;
+}
+
+static void testCommandFrames()
+{
+	for(uint8_t version = 1 ; version <= 2 ; version++)
+	{
+		master::Command_Packet sent(0x5A, Commands::DrawTriangle, 1, 2, 3, 4, 5, 250);
+		byte frame[Protocol::COMMAND_LENGTH];
+		sent.GetPacketBytes(frame, version);
+
+		slave::Command_Packet received(frame, false);
+		CHECK(received.valid);
+		CHECK_EQUAL(0x5A, received.id);
+		CHECK_EQUAL(Commands::DrawTriangle, received._command);
+		CHECK(memcmp(sent.Parameter, received.Parameter, Protocol::PARAMETER_COUNT) == 0);
+
+		// A flipped parameter bit passes version 1 framing, the CRC-8 of version 2 catches it.
+		frame[5] ^= 0x10;
+		CHECK_EQUAL(version == 1, slave::Command_Packet(frame, false).valid);
+	}
+
+	master::Command_Packet sent(0x21, Commands::Drive, 1, 200, 0, 90);
+	byte entry[Protocol::BATCH_ENTRY_SIZE];
+	sent.WriteBatchEntry(entry);
+	slave::Command_Packet received(0x21, entry);
+	CHECK(received.valid);
+	CHECK_EQUAL(Commands::Drive, received._command);
+	CHECK(memcmp(sent.Parameter, received.Parameter, Protocol::PARAMETER_COUNT) == 0);
+}
+
+static void testResponseFrames()
+{
+	for(uint8_t version = 1 ; version <= 2 ; version++)
+		for(uint8_t state = 0 ; state < 3 ; state++)
+		{
+			slave::Response_Packet sent(0x77);
+			sent.status = (state == 0);
+			sent.inProgress = (state == 1);
+			byte frame[Protocol::RESPONSE_LENGTH];
+			sent.GetPacketBytes(frame, version);
+
+			master::Response_Packet received(frame, false);
+			CHECK(received.valid);
+			CHECK_EQUAL(version, received.version);
+			CHECK_EQUAL(0x77, received._id);
+			CHECK_EQUAL(sent.status, received.status);
+			CHECK_EQUAL(sent.inProgress, received.inProgress);
+		}
+}
+
+static void testTelemetryFrames()
+{
+	Telemetry_Packet sent;
+	sent.sample = 200;
+	sent.mode = 2;
+	sent.posL = -123456;
+	sent.posR = 2000000000;
+	sent.omegaL = -12.34;
+	sent.omegaR = 500;									// Beyond 327.67 rad/s the field saturates.
+	sent.pwmL = -250;
+	sent.pwmR = 17;
+
+	byte frame[Protocol::TELEMETRY_LENGTH];
+	sent.GetPacketBytes(frame);
+	Telemetry_Packet received(frame, false);
+	CHECK(received.valid);
+	CHECK_EQUAL(200, received.sample);
+	CHECK_EQUAL(2, received.mode);
+	CHECK_EQUAL(-123456, received.posL);
+	CHECK_EQUAL(2000000000, received.posR);
+	CHECK_CLOSE(-12.34, received.omegaL, 0.01);
+	CHECK_CLOSE(327.67, received.omegaR, 0.001);
+	CHECK_EQUAL(-250, received.pwmL);
+	CHECK_EQUAL(17, received.pwmR);
+
+	frame[8] ^= 0x01;
+	CHECK(!Telemetry_Packet(frame, false).valid);
+	CHECK(!Telemetry_Packet().valid);
+}
+
+// Every command method of the master, as the slave decodes it from the bus.
+static void testCommandMethods()
+{
+	static Loopback link;
+	static Trace_Buffer trace;
+	link.begin();
+	link.master.setFlowControl(true);
+	link.master.setTrace(&trace);
+	CHECK_EQUAL(2, link.master.protocolVersion());
+
+	size_t mark;
+	#define FRAMES_OF(call) (mark = trace.bytes.size(), call, trace.frames(mark))
+
+	CHECK(decodes(FRAMES_OF(link.master.drawPoint(3, 4))[0], Commands::DrawPoint, 3, 4));
+	CHECK(decodes(FRAMES_OF(link.master.drawLine(1, 2, 127, 63))[0], Commands::DrawLine, 1, 2, 127, 63));
+	CHECK(decodes(FRAMES_OF(link.master.drawCircle(64, 32, 20))[0], Commands::DrawCircle, 64, 32, 20));
+	CHECK(decodes(FRAMES_OF(link.master.drawDisc(10, 11, 5))[0], Commands::DrawDisc, 10, 11, 5));
+	CHECK(decodes(FRAMES_OF(link.master.drawTriangle(1, 2, 3, 4, 5, 6))[0], Commands::DrawTriangle, 1, 2, 3, 4, 5, 6));
+	CHECK(decodes(FRAMES_OF(link.master.drawRectangle(7, 8, 9, 10))[0], Commands::DrawRectangle, 7, 8, 9, 10));
+	CHECK(decodes(FRAMES_OF(link.master.drawBox(11, 12, 13, 14))[0], Commands::DrawBox, 11, 12, 13, 14));
+	CHECK(decodes(FRAMES_OF(link.master.clearScreen())[0], Commands::ClearScreen));
+
+	// DrawText is followed by its text in Text Packets.
+	std::vector<std::vector<byte> > frames = FRAMES_OF(link.master.drawText((char*)"round trip"));
+	CHECK_EQUAL(2, frames.size());
+	CHECK(decodes(frames[0], Commands::DrawText));
+	CHECK_EQUAL(Protocol::TEXT_START_CODE, frames[1][0]);
+	CHECK_EQUAL(10, frames[1][1]);
+	CHECK(memcmp(&frames[1][Protocol::TEXT_HEADER_SIZE], "round trip", 10) == 0);
+
+	CHECK(decodes(FRAMES_OF(link.master.leftMotor(1, 180))[0], Commands::LeftMotor, 1, 180));
+	CHECK(decodes(FRAMES_OF(link.master.rightMotor(0, 90))[0], Commands::RightMotor, 0, 90));
+	CHECK(decodes(FRAMES_OF(link.master.move(1, 100))[0], Commands::Move, 1, 255));
+	CHECK(decodes(FRAMES_OF(link.master.turn(120, 0))[0], Commands::Turn, 0, 120));
+	CHECK(decodes(FRAMES_OF(link.master.stop())[0], Commands::Stop));
+
+	// Distances and angles travel as Fixed-point Parameters to version 2 slaves.
+	frames = FRAMES_OF(link.master.moveMillimeters(-1234, 150));
+	slave::Command_Packet cp(&frames[0][0], false);
+	CHECK(cp.valid);
+	CHECK_EQUAL(Commands::MoveMillimeters, cp._command);
+	CHECK_EQUAL(-1234, Protocol::readInt32(cp.Parameter));
+	CHECK_EQUAL(150, (uint16_t)Protocol::readInt16(&cp.Parameter[4]));
+	link.master.stop();
+
+	frames = FRAMES_OF(link.master.turnCentidegrees(9050, 45));
+	cp = slave::Command_Packet(&frames[0][0], false);
+	CHECK_EQUAL(Commands::TurnCentidegrees, cp._command);
+	CHECK_EQUAL(9050, Protocol::readInt32(cp.Parameter));
+	CHECK_EQUAL(45, Protocol::readInt16(&cp.Parameter[4]));
+	link.master.stop();
+
+	frames = FRAMES_OF(link.master.moveDistance(30, 0, 5));
+	cp = slave::Command_Packet(&frames[0][0], false);
+	CHECK_EQUAL(Commands::MoveMillimeters, cp._command);
+	CHECK_EQUAL(-300, Protocol::readInt32(cp.Parameter));
+	CHECK_EQUAL(50, Protocol::readInt16(&cp.Parameter[4]));
+	link.master.stop();
+
+	frames = FRAMES_OF(link.master.turnAngle(90, 1, 30));
+	cp = slave::Command_Packet(&frames[0][0], false);
+	CHECK_EQUAL(Commands::TurnCentidegrees, cp._command);
+	CHECK_EQUAL(-9000, Protocol::readInt32(cp.Parameter));
+	link.master.stop();
+
+	// The first setpoint goes out at once, the next ones of both motors within the interval as one Drive.
+	link.master.setCoalescing(true);
+	CHECK(decodes(FRAMES_OF(link.master.leftMotor(1, 10))[0], Commands::LeftMotor, 1, 10));
+	mark = trace.bytes.size();
+	link.master.leftMotor(1, 60);
+	link.master.rightMotor(0, 70);
+	link.master.flushMotors();
+	frames = trace.frames(mark);
+	CHECK_EQUAL(1, frames.size());
+	CHECK(decodes(frames[0], Commands::Drive, 1, 60, 0, 70));
+	link.master.setCoalescing(false);
+
+	#undef FRAMES_OF
+	link.master.setTrace(NULL);
+}
+
+// The telemetry the slave encodes from its Motion arrives decoded at the master.
+static void testTelemetryLink()
+{
+	static Loopback link;
+	link.begin();
+	link.slave.setTelemetryPeriod(0);
+	link.motors.wheel_l->pos = 4321;
+	link.motors.wheel_r->pos = -765;
+	delay(5);
+
+	Telemetry_Packet tp;
+	CHECK(link.master.readTelemetry(tp));
+	CHECK(tp.valid);
+	CHECK_EQUAL(link.motors.getMode(), tp.mode);
+	CHECK_EQUAL(4321, tp.posL);
+	CHECK_EQUAL(-765, tp.posR);
+}
+
+int main()
+{
+	testCommandFrames();
+	testResponseFrames();
+	testTelemetryFrames();
+	testCommandMethods();
+	testTelemetryLink();
+	return checkReport("test_protocol");
+}